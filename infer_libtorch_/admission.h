@@ -0,0 +1,426 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+#include "gdcmReader.h"
+#include "gdcmStringFilter.h"
+#include "dicom_decode.h"
+#include "model_output.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+// 内存预算参数
+struct AdmissionOptions
+{
+    uint64_t budget_bytes = 0;                            // 本机所有推理进程共享的内存预算, 0 表示不限制
+    std::string ledger_path = "/dev/shm/itk_torch_admission"; // 各进程预留记录 (跨进程共享)
+    double activation_factor = 8.0;                       // 模型中间激活约为输入 float 张量的倍数
+    int64_t output_channels = 2;                          // 估算输出体数据的通道数
+    int64_t min_slab = 16;                                // 分块执行时每块最少的 Z 切片数
+    int64_t slab_overlap = 8;                             // 相邻块在 Z 方向的重叠
+    std::chrono::milliseconds wait_timeout{60000};        // 整体执行等待超过该时间后降级为分块执行
+    std::chrono::milliseconds patch_wait_timeout{600000}; // 分块执行仍等不到预算时报错
+    uint64_t read_ahead_bytes = 0;                        // 启用预读时在途文件内容的上限 (ReadAheadOptions::max_inflight_bytes)
+    std::string patch_output_dir;                         // 流式分块输出文件所在目录, 为空时使用系统临时目录
+};
+
+// 根据序列头信息估算的峰值内存 (字节)
+struct MemoryEstimate
+{
+    int64_t size[3] = {0, 0, 0};
+    uint64_t decode_bytes = 0;     // ITK 解码缓冲 + imageData 拷贝
+    uint64_t preprocess_bytes = 0; // HU2uint8 输出的 float 张量
+    uint64_t model_bytes = 0;      // 模型权重
+    uint64_t activation_bytes = 0; // 前向传播中间激活
+    uint64_t output_bytes = 0;     // 输出体数据
+    uint64_t io_bytes = 0;         // 预读队列中尚未解码的文件内容
+
+    uint64_t Total() const { return decode_bytes + preprocess_bytes + model_bytes + activation_bytes + output_bytes + io_bytes; }
+};
+
+// 只读取第一个切片的头信息 (Rows / Columns / Bits Allocated), 不解码像素
+// pixelBytes 为解码后的像素类型大小 (见 PixelKindBytes)
+inline MemoryEstimate EstimateStudyMemory(const std::vector<std::string> &fileNames, const std::string &modelPath,
+                                          size_t pixelBytes, const AdmissionOptions &options)
+{
+    if (fileNames.empty())
+    {
+        throw std::runtime_error("Empty DICOM file list.");
+    }
+
+    gdcm::Reader reader;
+    reader.SetFileName(fileNames.front().c_str());
+    if (!reader.ReadUpToTag(gdcm::Tag(0x0028, 0x0100)))
+    {
+        throw std::runtime_error("Cannot read DICOM header: " + fileNames.front());
+    }
+    gdcm::StringFilter filter;
+    filter.SetFile(reader.GetFile());
+    int64_t rows = std::stoll(filter.ToString(gdcm::Tag(0x0028, 0x0010)));
+    int64_t columns = std::stoll(filter.ToString(gdcm::Tag(0x0028, 0x0011)));
+    std::string bits = filter.ToString(gdcm::Tag(0x0028, 0x0100));
+    int64_t bytesStored = bits.empty() ? 2 : std::max<int64_t>(1, std::stoll(bits) / 8);
+
+    MemoryEstimate est;
+    est.size[0] = columns;
+    est.size[1] = rows;
+    est.size[2] = static_cast<int64_t>(fileNames.size());
+    const uint64_t voxels = static_cast<uint64_t>(columns) * rows * fileNames.size();
+
+    // 解码: ITK 图像缓冲 + imageData 拷贝 (均为解码像素类型), 压缩文件按存储位宽多一份
+    est.decode_bytes = voxels * (2 * pixelBytes + bytesStored);
+    // 预处理: HU2uint8 一遍直接写出 float 张量
+    est.preprocess_bytes = voxels * sizeof(float);
+    est.model_bytes = std::filesystem::file_size(modelPath) * 2; // 反序列化时文件缓冲与参数同时存在
+    est.activation_bytes = static_cast<uint64_t>(voxels * sizeof(float) * options.activation_factor);
+    est.output_bytes = voxels * sizeof(float) * options.output_channels;
+    est.io_bytes = options.read_ahead_bytes;
+    return est;
+}
+
+// 分块执行 (沿 Z 方向的 slab) 的计划
+struct PatchPlan
+{
+    int64_t size[3] = {0, 0, 0}; // 序列尺寸 [X, Y, Z]
+    int64_t slab = 0;            // 每块 Z 切片数
+    int64_t overlap = 0;         // 块之间的重叠
+    uint64_t bytes = 0;          // 分块执行时的峰值估算
+    bool streaming = false;      // 流式: 每块只解码其覆盖的切片, 输出写入文件映射, 不常驻整个序列
+    std::string output_dir;      // 流式输出文件所在目录
+};
+
+// 流式分块输出文件所在目录
+inline std::filesystem::path PatchOutputDirectory(const AdmissionOptions &options)
+{
+    return options.patch_output_dir.empty() ? std::filesystem::temp_directory_path()
+                                            : std::filesystem::path(options.patch_output_dir);
+}
+
+// tmpfs / ramfs 上的文件页就是内存 (或 swap), 写回磁盘并不能释放; 无法判断时按内存处理
+inline bool IsMemoryBackedDirectory(const std::filesystem::path &dir)
+{
+    struct statfs st;
+    if (::statfs(dir.c_str(), &st) != 0)
+        return true;
+    constexpr unsigned long kTmpfsMagic = 0x01021994;
+    constexpr unsigned long kRamfsMagic = 0x858458f6;
+    return static_cast<unsigned long>(st.f_type) == kTmpfsMagic || static_cast<unsigned long>(st.f_type) == kRamfsMagic;
+}
+
+namespace detail
+{
+    // 在 budget - fixed 内选择最大的 slab 深度; 放不下最小 slab 时返回 0
+    inline int64_t LargestSlab(const MemoryEstimate &est, const AdmissionOptions &options, uint64_t fixed,
+                               uint64_t perSlice, int64_t overlap)
+    {
+        if (fixed >= options.budget_bytes)
+            return 0;
+        int64_t slab = static_cast<int64_t>((options.budget_bytes - fixed) / perSlice);
+        slab = std::min<int64_t>(slab, est.size[2]);
+        if (slab >= 16 && slab < est.size[2])
+            slab = slab / 16 * 16; // 对齐到 16, 适配下采样网络
+        if (slab < std::min<int64_t>(options.min_slab, est.size[2]) || slab <= 2 * overlap)
+            return 0;
+        return slab;
+    }
+}
+
+// 在预算内选择最大的 slab 深度; 预算连最小 slab 都放不下时返回 slab = 0
+// 先尝试常驻解码数据与全尺寸输出; 放不下时降级为流式分块, 常驻部分只剩模型 (输出目录在 tmpfs 上时还有输出)
+inline PatchPlan PlanPatchExecution(const MemoryEstimate &est, const AdmissionOptions &options)
+{
+    const uint64_t sliceVoxels = static_cast<uint64_t>(est.size[0]) * est.size[1];
+    // 每个 Z 切片在 slab 中的开销: 加窗后的 float 输入 + 激活 + slab 输出
+    const uint64_t perSlice = static_cast<uint64_t>(sliceVoxels * sizeof(float) *
+                                                    (1.0 + options.activation_factor + options.output_channels));
+
+    PatchPlan plan;
+    std::copy(est.size, est.size + 3, plan.size);
+    plan.overlap = std::min<int64_t>(options.slab_overlap, est.size[2] / 4);
+
+    // 常驻部分: 解码数据、预读队列、模型、全尺寸输出
+    uint64_t fixed = est.decode_bytes + est.io_bytes + est.model_bytes + est.output_bytes;
+    plan.slab = detail::LargestSlab(est, options, fixed, perSlice, plan.overlap);
+    if (plan.slab > 0)
+    {
+        plan.bytes = fixed + perSlice * plan.slab;
+        return plan;
+    }
+
+    // 流式: 每个切片多出其解码开销 (不使用预读); 全尺寸输出在文件映射中,
+    // 输出目录在磁盘上时脏页可随时写回, 不计入预算; 在 tmpfs 上时仍占用内存, 计入常驻部分
+    const uint64_t streamingPerSlice = perSlice + est.decode_bytes / std::max<int64_t>(1, est.size[2]);
+    plan.output_dir = PatchOutputDirectory(options).string();
+    fixed = est.model_bytes + (IsMemoryBackedDirectory(plan.output_dir) ? est.output_bytes : 0);
+    plan.slab = detail::LargestSlab(est, options, fixed, streamingPerSlice, plan.overlap);
+    if (plan.slab > 0)
+    {
+        plan.streaming = true;
+        plan.bytes = fixed + streamingPerSlice * plan.slab;
+    }
+    return plan;
+}
+
+// 跨进程的内存预留表: 每行 "pid bytes", 文件锁保护; 已退出进程的预留自动清除
+class MemoryAdmission
+{
+public:
+    explicit MemoryAdmission(const AdmissionOptions &options) : options_(options) {}
+
+    ~MemoryAdmission() { Release(); }
+
+    MemoryAdmission(const MemoryAdmission &) = delete;
+    MemoryAdmission &operator=(const MemoryAdmission &) = delete;
+
+    // 尝试预留 bytes, 在 timeout 内轮询等待其它进程释放; 超时返回 false
+    bool Acquire(uint64_t bytes, std::chrono::milliseconds timeout)
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (;;)
+        {
+            if (TryReserve(bytes))
+            {
+                reserved_ = bytes;
+                return true;
+            }
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+    }
+
+    // 当前所有进程预留的字节数 (不含已退出的进程)
+    uint64_t Reserved()
+    {
+        uint64_t used = 0;
+        WithLedger([&](std::vector<std::pair<long, uint64_t>> &entries)
+                   {
+                       for (const auto &e : entries)
+                           used += e.second;
+                       return false; });
+        return used;
+    }
+
+    void Release()
+    {
+        if (reserved_ == 0)
+            return;
+        WithLedger([](std::vector<std::pair<long, uint64_t>> &entries)
+                   {
+                       long self = static_cast<long>(::getpid());
+                       entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                                    [self](const auto &e)
+                                                    { return e.first == self; }),
+                                     entries.end());
+                       return true; });
+        reserved_ = 0;
+    }
+
+private:
+    bool TryReserve(uint64_t bytes)
+    {
+        return WithLedger([&](std::vector<std::pair<long, uint64_t>> &entries)
+                          {
+                              uint64_t used = 0;
+                              for (const auto &e : entries)
+                                  used += e.second;
+                              if (used + bytes > options_.budget_bytes)
+                                  return false;
+                              entries.emplace_back(static_cast<long>(::getpid()), bytes);
+                              return true; });
+    }
+
+    // 在文件锁内读取预留表, fn 返回 true 时写回
+    template <typename Fn>
+    bool WithLedger(Fn &&fn)
+    {
+        int fd = ::open(options_.ledger_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open admission ledger: " + options_.ledger_path);
+        }
+        ::flock(fd, LOCK_EX);
+
+        std::string text;
+        char buf[4096];
+        ssize_t n;
+        ::lseek(fd, 0, SEEK_SET);
+        while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+            text.append(buf, static_cast<size_t>(n));
+
+        std::vector<std::pair<long, uint64_t>> entries;
+        std::istringstream in(text);
+        long pid;
+        uint64_t bytes;
+        while (in >> pid >> bytes)
+        {
+            // 清除已退出进程的预留
+            if (::kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH)
+                entries.emplace_back(pid, bytes);
+        }
+
+        bool commit = fn(entries);
+        if (commit)
+        {
+            std::ostringstream out;
+            for (const auto &e : entries)
+                out << e.first << " " << e.second << "\n";
+            std::string data = out.str();
+            if (::ftruncate(fd, 0) != 0 || ::pwrite(fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size()))
+            {
+                ::flock(fd, LOCK_UN);
+                ::close(fd);
+                throw std::runtime_error("Cannot write admission ledger: " + options_.ledger_path);
+            }
+        }
+
+        ::flock(fd, LOCK_UN);
+        ::close(fd);
+        return commit;
+    }
+
+    AdmissionOptions options_;
+    uint64_t reserved_ = 0;
+};
+
+namespace detail
+{
+    // 分块执行的公共循环: slabPixels(begin, end) 返回 [Zs, Y, X] 排列的解码像素 (在下一次调用前有效)
+    // allocateOutput(channels, options) 分配 [1, C, X, Y, Z] 的全尺寸输出
+    template <typename TPixel, typename TSlabPixels, typename TAllocate>
+    torch::Tensor PatchInferenceLoop(torch::jit::script::Module &module, const int64_t size[3], const PatchPlan &plan,
+                                     torch::Device device, TSlabPixels &&slabPixels, TAllocate &&allocateOutput,
+                                     float HU_min, float HU_max)
+    {
+        torch::NoGradGuard no_grad;
+        const int64_t nx = size[0], ny = size[1], nz = size[2];
+        const int64_t step = plan.slab - 2 * plan.overlap;
+        const float scale = 1.0f / (HU_max - HU_min);
+        torch::Tensor output;
+
+        for (int64_t z0 = 0;; z0 += step)
+        {
+            int64_t begin = std::max<int64_t>(0, std::min(z0, nz - plan.slab));
+            int64_t end = std::min(nz, begin + plan.slab);
+            const int64_t nzs = end - begin;
+
+            // 与 HU2uint8 一致: 归一化到 [0, 1] 并截断, 同时调整为 [X, Y, Zs]
+            torch::Tensor input = torch::empty({nx, ny, nzs}, torch::kFloat32);
+            float *dst = input.data_ptr<float>();
+            const TPixel *src = slabPixels(begin, end);
+            at::parallel_for(0, nx * ny, 64, [&](int64_t rowBegin, int64_t rowEnd)
+                             {
+                                 for (int64_t r = rowBegin; r < rowEnd; ++r)
+                                 {
+                                     const TPixel *col = src + (r % ny) * nx + r / ny;
+                                     for (int64_t z = 0; z < nzs; ++z)
+                                     {
+                                         float x = static_cast<float>(col[z * ny * nx]);
+                                         dst[r * nzs + z] = std::min(1.0f, std::max(0.0f, (x - HU_min) * scale));
+                                     }
+                                 } });
+            input = input.unsqueeze(0).unsqueeze(0).to(device);
+
+            torch::jit::IValue out = module.forward({input});
+            torch::Tensor pred = FirstOutputTensor(out);
+            if (pred.dim() != 5 || pred.size(2) != nx || pred.size(3) != ny || pred.size(4) != nzs)
+            {
+                throw std::runtime_error("Patch execution requires a model whose output matches its input size.");
+            }
+            pred = pred.to(torch::kCPU);
+
+            if (!output.defined())
+            {
+                output = allocateOutput(pred.size(1), pred.options());
+            }
+
+            // 首尾块保留边界, 其余只写回去掉重叠后的中心部分
+            int64_t keepBegin = begin == 0 ? 0 : begin + plan.overlap;
+            int64_t keepEnd = end == nz ? nz : end - plan.overlap;
+            output.slice(4, keepBegin, keepEnd).copy_(pred.slice(4, keepBegin - begin, keepEnd - begin));
+
+            if (end == nz)
+                break;
+        }
+
+        return output;
+    }
+}
+
+// 分块执行: 沿 Z 方向逐 slab 加窗、推理, 只保留每块中心部分写回全尺寸输出
+// imageData 为 [Z, Y, X] 排列的解码像素, 每个 slab 直接由 TPixel 加窗写成 [X, Y, Zs] 的 float 输入
+template <typename TPixel>
+torch::Tensor RunPatchInference(torch::jit::script::Module &module, const std::vector<TPixel> &imageData,
+                                const int64_t size[3], const PatchPlan &plan, torch::Device device,
+                                float HU_min = -1024.0f, float HU_max = 300.0f)
+{
+    return detail::PatchInferenceLoop<TPixel>(
+        module, size, plan, device,
+        [&](int64_t begin, int64_t)
+        { return imageData.data() + begin * size[1] * size[0]; },
+        [&](int64_t channels, const torch::TensorOptions &options)
+        { return torch::empty({1, channels, size[0], size[1], size[2]}, options); },
+        HU_min, HU_max);
+}
+
+// 流式分块执行: 不解码整个序列, 每个 slab 只并行解码其覆盖的切片
+// 全尺寸输出放在 plan.output_dir 中临时文件的共享映射中 (按 Z 连续存放, 每块写入一段连续区域), 脏页可写回磁盘后回收
+// fileNames 为 ITKGetDICOMSeriesFileNames 的有序列表, size 为 [X, Y, Z]
+template <typename TPixel>
+torch::Tensor RunStreamingPatchInference(torch::jit::script::Module &module, const std::vector<std::string> &fileNames,
+                                         const int64_t size[3], const PatchPlan &plan, torch::Device device,
+                                         float HU_min = -1024.0f, float HU_max = 300.0f)
+{
+    typename itk::Image<TPixel, 3>::Pointer slabImage;
+    return detail::PatchInferenceLoop<TPixel>(
+        module, size, plan, device,
+        [&](int64_t begin, int64_t end)
+        {
+            slabImage = nullptr; // 先释放上一块
+            std::vector<std::string> slabFiles(fileNames.begin() + begin, fileNames.begin() + end);
+            slabImage = ParallelDecodeSeries<TPixel>(slabFiles);
+            return static_cast<const TPixel *>(slabImage->GetBufferPointer());
+        },
+        [&](int64_t channels, const torch::TensorOptions &options)
+        {
+            std::filesystem::path dir = plan.output_dir.empty() ? std::filesystem::temp_directory_path()
+                                                                 : std::filesystem::path(plan.output_dir);
+            std::string path = (dir / "itk_torch_patch_XXXXXX").string();
+            int fd = ::mkstemp(path.data());
+            if (fd < 0)
+            {
+                throw std::runtime_error("Cannot create patch output file in " + dir.string());
+            }
+            ::unlink(path.c_str()); // 进程退出后自动删除
+            const size_t bytes = static_cast<size_t>(channels * size[0] * size[1] * size[2]) * options.dtype().itemsize();
+            void *data = MAP_FAILED;
+            if (::ftruncate(fd, static_cast<off_t>(bytes)) == 0)
+                data = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (data == MAP_FAILED)
+            {
+                throw std::runtime_error("Cannot map patch output file.");
+            }
+            // 存储为 [1, C, Z, Y, X], 对外为 [1, C, X, Y, Z] 视图
+            return torch::from_blob(data, {1, channels, size[2], size[1], size[0]}, [bytes](void *p)
+                                    { ::munmap(p, bytes); }, options)
+                .permute({0, 1, 4, 3, 2});
+        },
+        HU_min, HU_max);
+}
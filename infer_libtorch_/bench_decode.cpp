@@ -0,0 +1,218 @@
+#include "itkImage.h"
+#include "itkGDCMImageIO.h"
+#include "itkGDCMSeriesFileNames.h"
+#include "itkImageSeriesReader.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "dicom_decode.h"
+
+// 定义影像类型
+using PixelType = signed short;
+constexpr unsigned int Dimension = 3;
+using ImageType = itk::Image<PixelType, Dimension>;
+
+// 每种传输语法的累计统计
+struct DecodeStats
+{
+    size_t series = 0;
+    size_t slices = 0;
+    double megabytes = 0.0;
+    double itk_ms = 0.0;
+    double parallel_ms = 0.0;
+};
+
+// 获取目录中第一个序列的有序文件列表
+std::vector<std::string> GetSeriesFileNames(const std::string &dirName)
+{
+    auto nameGenerator = itk::GDCMSeriesFileNames::New();
+    nameGenerator->SetUseSeriesDetails(true);
+    nameGenerator->AddSeriesRestriction("0008|0021");
+    nameGenerator->SetGlobalWarningDisplay(false);
+    nameGenerator->SetDirectory(dirName);
+
+    const std::vector<std::string> &seriesUID = nameGenerator->GetSeriesUIDs();
+    if (seriesUID.empty())
+    {
+        throw std::runtime_error("No DICOMs found in: " + dirName);
+    }
+    return nameGenerator->GetFileNames(seriesUID.front());
+}
+
+// 顺序读取所有文件一遍, 使其进入页缓存
+void WarmPageCache(const std::vector<std::string> &fileNames)
+{
+    std::vector<char> chunk(1 << 20);
+    for (const auto &fileName : fileNames)
+    {
+        std::ifstream in(fileName, std::ios::binary);
+        while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0)
+        {
+        }
+    }
+}
+
+template <typename Fn>
+double TimeMs(Fn &&fn)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <directory> [<directory> ...] [--threads N] [--read-ahead]"
+                  << " [--io-depth N] [--io-inflight-mb N] [--io-latency-ms N] [--io-thread-pool]\n";
+        return -1;
+    }
+
+    unsigned int numThreads = 0;
+    bool benchReadAhead = false;
+    ReadAheadOptions readAhead;
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            numThreads = std::stoi(argv[++i]);
+        else if (arg == "--read-ahead")
+            benchReadAhead = true;
+        else if (arg == "--io-depth" && i + 1 < argc)
+            readAhead.queue_depth = std::stoi(argv[++i]);
+        else if (arg == "--io-inflight-mb" && i + 1 < argc)
+            readAhead.max_inflight_bytes = std::stoull(argv[++i]) << 20;
+        else if (arg == "--io-latency-ms" && i + 1 < argc)
+            readAhead.io_latency_ms = std::stoi(argv[++i]);
+        else if (arg == "--io-thread-pool")
+            readAhead.use_uring = false;
+        else
+            dirs.push_back(argv[i]);
+    }
+
+    std::map<std::string, DecodeStats> stats;
+
+    try
+    {
+        for (const auto &dirName : dirs)
+        {
+            std::vector<std::string> fileNames = GetSeriesFileNames(dirName);
+            DicomSliceLayout layout = DetectSliceLayout(fileNames.front());
+            std::string tsName = TransferSyntaxName(layout.ts);
+            if (!layout.ParallelDecodable())
+            {
+                // 多帧、彩色等并行解码不支持的序列不参与比较
+                std::cout << dirName << "  [" << tsName << "]  skipped: " << layout.frames << " frames, " << layout.samples
+                          << " samples, " << layout.photometric << std::endl;
+                continue;
+            }
+
+            // 计时前先把所有切片读入页缓存, 两条路径都在缓存已热的状态下比较解码速度
+            WarmPageCache(fileNames);
+
+            ImageType::Pointer itkImage;
+            auto runItk = [&]()
+            {
+                return TimeMs([&]()
+                              {
+                                  auto reader = itk::ImageSeriesReader<ImageType>::New();
+                                  reader->SetImageIO(itk::GDCMImageIO::New());
+                                  reader->SetFileNames(fileNames);
+                                  reader->ForceOrthogonalDirectionOff();
+                                  reader->Update();
+                                  itkImage = reader->GetOutput(); });
+            };
+
+            ImageType::Pointer parallelImage;
+            auto runParallel = [&]()
+            {
+                return TimeMs([&]()
+                              { parallelImage = ParallelDecodeSeries<PixelType>(fileNames, numThreads); });
+            };
+
+            // 每个序列交替先后顺序, 抵消剩余的顺序效应 (分配器、CPU 频率等)
+            double itkMs = 0.0;
+            double parallelMs = 0.0;
+            if (stats[tsName].series % 2 == 0)
+            {
+                itkMs = runItk();
+                parallelMs = runParallel();
+            }
+            else
+            {
+                parallelMs = runParallel();
+                itkMs = runItk();
+            }
+
+            // 校验两条路径的结果一致
+            size_t count = itkImage->GetLargestPossibleRegion().GetNumberOfPixels();
+            if (count != parallelImage->GetLargestPossibleRegion().GetNumberOfPixels() ||
+                !std::equal(itkImage->GetBufferPointer(), itkImage->GetBufferPointer() + count, parallelImage->GetBufferPointer()))
+            {
+                std::cerr << "Warning: parallel decode differs from ITK for " << dirName << std::endl;
+            }
+
+            DecodeStats &s = stats[tsName];
+            s.series += 1;
+            s.slices += fileNames.size();
+            s.megabytes += count * sizeof(PixelType) / (1024.0 * 1024.0);
+            s.itk_ms += itkMs;
+            s.parallel_ms += parallelMs;
+
+            std::cout << dirName << "  [" << tsName << "]  " << fileNames.size() << " slices  ITK " << itkMs
+                      << " ms  parallel " << parallelMs << " ms" << std::endl;
+
+            // 预读对比: 同一时刻只有一个读请求 (深度 1) 与多个读请求在途, 可配合 --io-latency-ms 模拟 NFS 延迟
+            if (benchReadAhead)
+            {
+                ReadAheadOptions sequential = readAhead;
+                sequential.queue_depth = 1;
+                // 两次运行的解码线程数相同, 只改变在途读请求数
+                double sequentialMs = TimeMs([&]()
+                                             {
+                                                 DicomReadAhead prefetch(fileNames, sequential);
+                                                 ParallelDecodeSeries<PixelType>(fileNames, numThreads, &prefetch); });
+                bool uring = false;
+                double readAheadMs = TimeMs([&]()
+                                            {
+                                                DicomReadAhead prefetch(fileNames, readAhead);
+                                                uring = prefetch.UsingUring();
+                                                ParallelDecodeSeries<PixelType>(fileNames, numThreads, &prefetch); });
+                std::cout << "    read-ahead (" << (uring ? "io_uring" : "thread pool") << ", depth " << readAhead.queue_depth
+                          << ", inflight " << (readAhead.max_inflight_bytes >> 20) << " MB, latency "
+                          << readAhead.io_latency_ms << " ms)  depth 1 " << sequentialMs
+                          << " ms  read-ahead " << readAheadMs << " ms" << std::endl;
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+
+    // 按传输语法汇总吞吐量
+    std::cout << std::endl
+              << std::left << std::setw(28) << "Transfer syntax" << std::right << std::setw(8) << "series"
+              << std::setw(10) << "slices" << std::setw(14) << "ITK MB/s" << std::setw(16) << "parallel MB/s"
+              << std::setw(10) << "speedup" << std::endl;
+    for (const auto &[name, s] : stats)
+    {
+        double itkRate = s.megabytes / (s.itk_ms / 1000.0);
+        double parallelRate = s.megabytes / (s.parallel_ms / 1000.0);
+        std::cout << std::left << std::setw(28) << name << std::right << std::setw(8) << s.series
+                  << std::setw(10) << s.slices << std::setw(14) << std::fixed << std::setprecision(1) << itkRate
+                  << std::setw(16) << parallelRate << std::setw(10) << std::setprecision(2) << parallelRate / itkRate
+                  << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,340 @@
+#include <torch/torch.h>
+#include <torch/script.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "mmap_weights.h"
+
+// 单个工作进程的测量结果
+struct WorkerStats
+{
+    double load_ms = 0.0;
+    double forward_ms = 0.0;
+    uint64_t rss_kb = 0;      // VmRSS
+    uint64_t rss_anon_kb = 0; // RssAnon: 进程私有内存 (jit::load 的权重在这里)
+    uint64_t rss_file_kb = 0; // RssFile: 文件映射 (映射的权重在这里, 多进程共享)
+    uint64_t pss_kb = 0;      // Pss: 共享页按进程数均摊, 各进程之和即主机实际占用
+};
+
+// 读取 /proc/self/<file> 中 "<key>: <value> kB" 形式的字段
+uint64_t ReadProcKb(const std::string &file, const std::string &key)
+{
+    std::ifstream in("/proc/self/" + file);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.compare(0, key.size() + 1, key + ":") == 0)
+            return std::stoull(line.substr(key.size() + 1));
+    }
+    return 0;
+}
+
+// 把文件从页缓存中清除 (尽力而为), 用于测量冷启动
+void DropFromPageCache(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+// 工作进程: 加载模型 (可选执行一次前向), 通知父进程后等待, 所有进程都加载完毕后再测量内存
+int RunWorker(const std::string &mode, const std::string &modelPath, const std::string &weightsDir,
+              const std::vector<int64_t> &inputSize, int readyFd, int goFd, int resultFd)
+{
+    torch::NoGradGuard no_grad;
+    torch::jit::getProfilingMode() = false;
+    WorkerStats stats;
+
+    auto t0 = std::chrono::steady_clock::now();
+    torch::jit::script::Module module;
+    if (mode == "jit")
+        module = torch::jit::load(modelPath);
+    else if (mode == "mmap")
+        module = LoadMappedModule(modelPath, weightsDir);
+    else if (mode == "export")
+        ExportMappedWeights(modelPath, weightsDir);
+    auto t1 = std::chrono::steady_clock::now();
+    stats.load_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+    if (mode == "jit" || mode == "mmap")
+    {
+        module.eval();
+        if (!inputSize.empty())
+        {
+            std::vector<int64_t> shape{1, 1};
+            shape.insert(shape.end(), inputSize.begin(), inputSize.end());
+            module.forward({torch::rand(shape)});
+            stats.forward_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+        }
+    }
+
+    char byte = 1;
+    if (::write(readyFd, &byte, 1) != 1)
+        return -1;
+    while (::read(goFd, &byte, 1) > 0)
+    {
+    }
+
+    stats.rss_kb = ReadProcKb("status", "VmRSS");
+    stats.rss_anon_kb = ReadProcKb("status", "RssAnon");
+    stats.rss_file_kb = ReadProcKb("status", "RssFile");
+    stats.pss_kb = ReadProcKb("smaps_rollup", "Pss");
+
+    std::ostringstream line;
+    line << stats.load_ms << " " << stats.forward_ms << " " << stats.rss_kb << " " << stats.rss_anon_kb << " "
+         << stats.rss_file_kb << " " << stats.pss_kb << "\n";
+    std::string text = line.str();
+    return ::write(resultFd, text.data(), text.size()) == static_cast<ssize_t>(text.size()) ? 0 : -1;
+}
+
+// 以全新进程 (重新 exec 自身) 启动 workers 个工作进程, 使各进程的 RSS 不包含父进程的内存
+std::vector<WorkerStats> RunWorkers(const char *self, const std::string &mode, const std::string &modelPath,
+                                    const std::string &weightsDir, const std::vector<int64_t> &inputSize,
+                                    int workers, double &wallMs)
+{
+    // 读端 / 写端中只有工作进程需要的一端保留到 exec 之后
+    int ready[2], go[2], result[2];
+    if (::pipe2(ready, O_CLOEXEC) != 0 || ::pipe2(go, O_CLOEXEC) != 0 || ::pipe2(result, O_CLOEXEC) != 0)
+    {
+        throw std::runtime_error("Cannot create pipes.");
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<pid_t> pids;
+    for (int i = 0; i < workers; ++i)
+    {
+        pid_t pid = ::fork();
+        if (pid < 0)
+        {
+            throw std::runtime_error("fork failed.");
+        }
+        if (pid == 0)
+        {
+            int readyFd = ::dup(ready[1]);
+            int goFd = ::dup(go[0]);
+            int resultFd = ::dup(result[1]);
+            std::string size;
+            for (int64_t s : inputSize)
+                size += (size.empty() ? "" : ",") + std::to_string(s);
+            std::vector<std::string> args = {self, "--worker", mode, modelPath, weightsDir, size.empty() ? "-" : size,
+                                             std::to_string(readyFd), std::to_string(goFd), std::to_string(resultFd)};
+            std::vector<char *> argv;
+            for (auto &a : args)
+                argv.push_back(a.data());
+            argv.push_back(nullptr);
+            ::execv("/proc/self/exe", argv.data());
+            ::_exit(127);
+        }
+        pids.push_back(pid);
+    }
+    ::close(ready[1]);
+    ::close(go[0]);
+    ::close(result[1]);
+
+    // 所有进程加载完毕 (同时驻留) 后再让它们测量内存
+    // 存活的工作进程持有 ready 写端, 某个进程提前退出时 read 不会返回 EOF, 因此轮询并检查子进程状态
+    std::vector<bool> reaped(pids.size(), false);
+    std::string failure;
+    int readyCount = 0;
+    while (readyCount < workers && failure.empty())
+    {
+        pollfd pfd{ready[0], POLLIN, 0};
+        int rc = ::poll(&pfd, 1, 200);
+        if (rc < 0 && errno != EINTR)
+        {
+            failure = "poll failed";
+            break;
+        }
+        char byte;
+        if (rc > 0 && ::read(ready[0], &byte, 1) == 1)
+        {
+            ++readyCount;
+            continue;
+        }
+        // 就绪前退出的进程 (工作进程在 go 关闭之前不会退出)
+        for (size_t i = 0; i < pids.size(); ++i)
+        {
+            int status = 0;
+            if (!reaped[i] && ::waitpid(pids[i], &status, WNOHANG) == pids[i])
+            {
+                reaped[i] = true;
+                failure = "worker " + std::to_string(pids[i]) +
+                          (WIFSIGNALED(status) ? " killed by signal " + std::to_string(WTERMSIG(status))
+                                               : " exited with status " + std::to_string(WEXITSTATUS(status))) +
+                          " before it was ready";
+                break;
+            }
+        }
+    }
+    wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    ::close(go[1]);
+
+    if (!failure.empty())
+    {
+        // 其余进程可能仍在加载, 直接结束
+        for (size_t i = 0; i < pids.size(); ++i)
+        {
+            if (!reaped[i])
+            {
+                ::kill(pids[i], SIGKILL);
+                ::waitpid(pids[i], nullptr, 0);
+            }
+        }
+        ::close(ready[0]);
+        ::close(result[0]);
+        throw std::runtime_error("Benchmark failed (mode " + mode + "): " + failure + ".");
+    }
+
+    std::string text;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(result[0], buf, sizeof(buf))) > 0)
+        text.append(buf, static_cast<size_t>(n));
+    ::close(ready[0]);
+    ::close(result[0]);
+
+    for (size_t i = 0; i < pids.size(); ++i)
+    {
+        int status = 0;
+        if (!reaped[i])
+            ::waitpid(pids[i], &status, 0);
+    }
+
+    std::vector<WorkerStats> stats;
+    std::istringstream in(text);
+    WorkerStats s;
+    while (in >> s.load_ms >> s.forward_ms >> s.rss_kb >> s.rss_anon_kb >> s.rss_file_kb >> s.pss_kb)
+        stats.push_back(s);
+    if (static_cast<int>(stats.size()) != workers)
+    {
+        throw std::runtime_error("Only " + std::to_string(stats.size()) + " of " + std::to_string(workers) +
+                                 " workers reported (mode " + mode + ").");
+    }
+    return stats;
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc >= 9 && std::string(argv[1]) == "--worker")
+    {
+        std::vector<int64_t> inputSize;
+        std::string size = argv[5];
+        if (size != "-")
+        {
+            std::istringstream ss(size);
+            std::string item;
+            while (std::getline(ss, item, ','))
+                inputSize.push_back(std::stoll(item));
+        }
+        try
+        {
+            return RunWorker(argv[2], argv[3], argv[4], inputSize, std::stoi(argv[6]), std::stoi(argv[7]), std::stoi(argv[8]));
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Worker error: " << e.what() << std::endl;
+            return -1;
+        }
+    }
+
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <model.pt> <weights-dir> [--workers N] [--input X Y Z] [--cold]\n"
+                  << "  Starts N worker processes per load path (none / jit / mmap) and reports startup time and memory\n"
+                  << "  --input X Y Z  also run one forward pass on a random [1, 1, X, Y, Z] input in every worker\n"
+                  << "  --cold         drop the model and weights files from the page cache before each run\n";
+        return -1;
+    }
+
+    std::string modelPath = argv[1];
+    std::string weightsDir = argv[2];
+    int workers = 8;
+    bool cold = false;
+    std::vector<int64_t> inputSize;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc)
+            workers = std::stoi(argv[++i]);
+        else if (arg == "--input" && i + 3 < argc)
+        {
+            for (int d = 0; d < 3; ++d)
+                inputSize.push_back(std::stoll(argv[++i]));
+        }
+        else if (arg == "--cold")
+            cold = true;
+    }
+
+    try
+    {
+        // 导出在独立进程中完成, 避免父进程持有模型内存
+        double exportMs = 0.0;
+        RunWorkers(argv[0], "export", modelPath, weightsDir, {}, 1, exportMs);
+        MappedWeightsPaths paths = GetMappedWeightsPaths(modelPath, weightsDir);
+        std::cout << "Weights file: " << paths.weights << " (" << (std::filesystem::file_size(paths.weights) >> 10)
+                  << " KB), model file " << (std::filesystem::file_size(modelPath) >> 10) << " KB" << std::endl;
+
+        std::cout << std::endl
+                  << std::left << std::setw(8) << "mode" << std::right << std::setw(12) << "wall ms"
+                  << std::setw(12) << "load ms" << std::setw(14) << "forward ms" << std::setw(12) << "RSS MB"
+                  << std::setw(12) << "anon MB" << std::setw(12) << "file MB" << std::setw(12) << "PSS MB"
+                  << std::setw(16) << "total PSS MB" << std::endl;
+
+        // none: 只有 LibTorch 运行时本身, 作为内存基线
+        for (const std::string mode : {"none", "jit", "mmap"})
+        {
+            if (cold)
+            {
+                DropFromPageCache(modelPath);
+                DropFromPageCache(paths.skeleton.string());
+                DropFromPageCache(paths.weights.string());
+            }
+
+            double wallMs = 0.0;
+            std::vector<WorkerStats> stats = RunWorkers(argv[0], mode, modelPath, weightsDir, inputSize, workers, wallMs);
+
+            WorkerStats mean;
+            uint64_t totalPss = 0;
+            for (const auto &s : stats)
+            {
+                mean.load_ms += s.load_ms / stats.size();
+                mean.forward_ms += s.forward_ms / stats.size();
+                mean.rss_kb += s.rss_kb / stats.size();
+                mean.rss_anon_kb += s.rss_anon_kb / stats.size();
+                mean.rss_file_kb += s.rss_file_kb / stats.size();
+                mean.pss_kb += s.pss_kb / stats.size();
+                totalPss += s.pss_kb;
+            }
+
+            std::cout << std::left << std::setw(8) << mode << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(12) << wallMs << std::setw(12) << mean.load_ms << std::setw(14) << mean.forward_ms
+                      << std::setw(12) << mean.rss_kb / 1024.0 << std::setw(12) << mean.rss_anon_kb / 1024.0
+                      << std::setw(12) << mean.rss_file_kb / 1024.0 << std::setw(12) << mean.pss_kb / 1024.0
+                      << std::setw(16) << totalPss / 1024.0 << std::endl;
+        }
+        std::cout << std::endl
+                  << workers << " workers per mode; per-worker values are means, PSS divides shared pages among the workers."
+                  << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+#include "model_output.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// 两级级联推理参数
+struct CascadeOptions
+{
+    std::string localizer_path;   // 低分辨率定位模型
+    double coarse_spacing = 4.0;  // 定位阶段的各向同性 spacing (mm)
+    double threshold = 0.5;       // 定位输出的前景概率阈值
+    double margin_mm = 10.0;      // ROI 向外扩展的物理距离 (mm)
+    int roi_multiple = 16;        // ROI 各边长对齐到该倍数, 适配下采样网络
+    int64_t min_voxels = 1;       // 低分辨率连通域的最小体素数
+};
+
+// 全分辨率下的 ROI, 半开区间 [begin, end)
+struct RegionOfInterest
+{
+    std::array<int64_t, 3> begin;
+    std::array<int64_t, 3> end;
+};
+
+// 各阶段耗时 (ms)
+struct CascadeTiming
+{
+    double downsample_ms = 0.0;
+    double localize_ms = 0.0;
+    double roi_ms = 0.0;
+    double refine_ms = 0.0;
+    double total_ms = 0.0;
+};
+
+struct CascadeResult
+{
+    torch::Tensor output; // [1, Co, X, Y, Z], ROI 之外为背景
+    std::vector<RegionOfInterest> rois;
+    CascadeTiming timing;
+};
+
+namespace detail
+{
+    // CUDA 上的算子异步执行, 计时前先等待设备完成, 否则耗时会计入下一阶段
+    inline double ElapsedMs(std::chrono::steady_clock::time_point &t, torch::Device device)
+    {
+        if (device.is_cuda())
+            torch::cuda::synchronize(device.index());
+        auto now = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - t).count();
+        t = now;
+        return ms;
+    }
+
+    // 低分辨率前景掩膜的 6 连通域包围盒, 单位为掩膜体素索引
+    inline std::vector<RegionOfInterest> ConnectedBoxes(const torch::Tensor &mask, int64_t minVoxels)
+    {
+        torch::Tensor m = mask.to(torch::kCPU, torch::kUInt8).contiguous();
+        const int64_t nx = m.size(0), ny = m.size(1), nz = m.size(2);
+        const uint8_t *data = m.data_ptr<uint8_t>();
+        std::vector<uint8_t> visited(m.numel(), 0);
+        std::vector<int64_t> stack;
+        std::vector<RegionOfInterest> boxes;
+
+        auto offset = [&](int64_t x, int64_t y, int64_t z)
+        { return (x * ny + y) * nz + z; };
+
+        for (int64_t start = 0; start < m.numel(); ++start)
+        {
+            if (!data[start] || visited[start])
+                continue;
+
+            RegionOfInterest box{{nx, ny, nz}, {0, 0, 0}};
+            int64_t count = 0;
+            stack.push_back(start);
+            visited[start] = 1;
+            while (!stack.empty())
+            {
+                int64_t v = stack.back();
+                stack.pop_back();
+                std::array<int64_t, 3> p{v / (ny * nz), (v / nz) % ny, v % nz};
+                for (int d = 0; d < 3; ++d)
+                {
+                    box.begin[d] = std::min(box.begin[d], p[d]);
+                    box.end[d] = std::max(box.end[d], p[d] + 1);
+                }
+                ++count;
+
+                static const int steps[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+                for (const auto &s : steps)
+                {
+                    int64_t x = p[0] + s[0], y = p[1] + s[1], z = p[2] + s[2];
+                    if (x < 0 || y < 0 || z < 0 || x >= nx || y >= ny || z >= nz)
+                        continue;
+                    int64_t o = offset(x, y, z);
+                    if (data[o] && !visited[o])
+                    {
+                        visited[o] = 1;
+                        stack.push_back(o);
+                    }
+                }
+            }
+
+            if (count >= minVoxels)
+                boxes.push_back(box);
+        }
+        return boxes;
+    }
+}
+
+// 两级级联: 多线程下采样 -> 定位模型找 ROI -> 仅在 ROI 上运行全分辨率模型
+// volume: [X, Y, Z] 预处理后的全分辨率体数据; spacing 取自 ITKLoadDICOMSeries (mm)
+// 两级网格共用同一 origin / direction, ROI 直接在索引空间换算, 不需要物理坐标
+inline CascadeResult RunCascadeInference(torch::jit::script::Module &localizer, torch::jit::script::Module &refiner,
+                                         const torch::Tensor &volume, const std::array<double, 3> &spacing,
+                                         const CascadeOptions &options, torch::Device device)
+{
+    torch::NoGradGuard no_grad;
+    CascadeResult result;
+    auto start = std::chrono::steady_clock::now();
+    auto t = start;
+
+    // 1. 下采样到 coarse_spacing (adaptive_avg_pool3d 由 ATen 线程池并行执行)
+    std::array<int64_t, 3> fullSize{volume.size(0), volume.size(1), volume.size(2)};
+    std::vector<int64_t> coarseSize(3);
+    std::array<double, 3> factor;
+    for (int d = 0; d < 3; ++d)
+    {
+        double extent = fullSize[d] * spacing[d];
+        coarseSize[d] = std::max<int64_t>(1, static_cast<int64_t>(std::lround(extent / options.coarse_spacing)));
+        factor[d] = static_cast<double>(fullSize[d]) / coarseSize[d];
+    }
+
+    torch::Tensor input = volume.unsqueeze(0).unsqueeze(0).to(device);
+    torch::Tensor coarseInput = torch::adaptive_avg_pool3d(input, coarseSize);
+    result.timing.downsample_ms = detail::ElapsedMs(t, device);
+
+    // 2. 低分辨率定位
+    torch::jit::IValue locOutput = localizer.forward({coarseInput});
+    torch::Tensor logits = FirstOutputTensor(locOutput);
+    torch::Tensor foreground = logits.size(1) == 1 ? torch::sigmoid(logits[0][0])
+                                                   : 1.0 - torch::softmax(logits[0], 0)[0];
+    torch::Tensor mask = (foreground > options.threshold).to(torch::kCPU);
+    result.timing.localize_ms = detail::ElapsedMs(t, device);
+
+    // 3. 连通域包围盒映射回全分辨率索引 (定位输出尺寸可能与输入不同, 先换算到 coarse 网格)
+    std::vector<RegionOfInterest> boxes = detail::ConnectedBoxes(mask, options.min_voxels);
+    for (const auto &box : boxes)
+    {
+        std::array<double, 3> lo, hi;
+        for (int d = 0; d < 3; ++d)
+        {
+            double scale = static_cast<double>(coarseSize[d]) / mask.size(d);
+            lo[d] = box.begin[d] * scale - 0.5;
+            hi[d] = box.end[d] * scale - 0.5;
+        }
+        // 低分辨率体素中心位于其覆盖的全分辨率体素块的中心
+        std::array<double, 3> loFull, hiFull;
+        for (int d = 0; d < 3; ++d)
+        {
+            loFull[d] = lo[d] * factor[d] + (factor[d] - 1.0) / 2.0;
+            hiFull[d] = hi[d] * factor[d] + (factor[d] - 1.0) / 2.0;
+        }
+
+        RegionOfInterest roi;
+        for (int d = 0; d < 3; ++d)
+        {
+            double margin = options.margin_mm / spacing[d];
+            int64_t b = static_cast<int64_t>(std::floor(std::min(loFull[d], hiFull[d]) - margin));
+            int64_t e = static_cast<int64_t>(std::ceil(std::max(loFull[d], hiFull[d]) + margin)) + 1;
+            b = std::max<int64_t>(0, b);
+            e = std::min<int64_t>(fullSize[d], e);
+
+            // 边长向上对齐到 roi_multiple, 超出边界时向前扩展
+            int64_t length = e - b;
+            int64_t aligned = ((length + options.roi_multiple - 1) / options.roi_multiple) * options.roi_multiple;
+            aligned = std::min(aligned, fullSize[d]);
+            e = std::min<int64_t>(fullSize[d], b + aligned);
+            b = std::max<int64_t>(0, e - aligned);
+            roi.begin[d] = b;
+            roi.end[d] = e;
+        }
+        result.rois.push_back(roi);
+    }
+    result.timing.roi_ms = detail::ElapsedMs(t, device);
+
+    // 4. 仅在 ROI 上运行全分辨率模型, 结果写回全尺寸输出; coverage 记录已写入的体素
+    torch::Tensor coverage;
+    for (const auto &roi : result.rois)
+    {
+        torch::Tensor crop = input.slice(2, roi.begin[0], roi.end[0])
+                                 .slice(3, roi.begin[1], roi.end[1])
+                                 .slice(4, roi.begin[2], roi.end[2])
+                                 .contiguous();
+        torch::jit::IValue out = refiner.forward({crop});
+        torch::Tensor pred = FirstOutputTensor(out);
+
+        if (pred.dim() != 5 || pred.size(2) != crop.size(2) || pred.size(3) != crop.size(3) || pred.size(4) != crop.size(4))
+        {
+            throw std::runtime_error("Cascade refiner must return [1, C, x, y, z] matching its input ROI.");
+        }
+        if (!result.output.defined())
+        {
+            result.output = torch::zeros({1, pred.size(1), fullSize[0], fullSize[1], fullSize[2]}, pred.options());
+            coverage = torch::zeros({fullSize[0], fullSize[1], fullSize[2]}, pred.options().dtype(torch::kBool));
+        }
+
+        // 首次写入的体素直接拷贝, 只有多个 ROI 重叠的体素取最大值 (保留负的 logit)
+        torch::Tensor target = result.output.slice(2, roi.begin[0], roi.end[0])
+                                   .slice(3, roi.begin[1], roi.end[1])
+                                   .slice(4, roi.begin[2], roi.end[2]);
+        torch::Tensor covered = coverage.slice(0, roi.begin[0], roi.end[0])
+                                    .slice(1, roi.begin[1], roi.end[1])
+                                    .slice(2, roi.begin[2], roi.end[2]);
+        target.copy_(torch::where(covered, torch::maximum(target, pred), pred));
+        covered.fill_(true);
+    }
+
+    // ROI 之外为背景: 单通道输出填最小值, 多通道输出将第 0 通道 (背景) 设为 1, 其余为 0
+    if (result.output.defined())
+    {
+        torch::Tensor background = coverage.logical_not();
+        if (result.output.size(1) == 1)
+        {
+            result.output[0][0].masked_fill_(background, std::numeric_limits<float>::lowest());
+        }
+        else
+        {
+            result.output[0][0].masked_fill_(background, 1.0);
+        }
+    }
+    result.timing.refine_ms = detail::ElapsedMs(t, device);
+    result.timing.total_ms = std::chrono::duration<double, std::milli>(t - start).count();
+
+    std::cout << "Cascade: " << result.rois.size() << " ROIs" << std::endl;
+    for (const auto &roi : result.rois)
+    {
+        std::cout << "  ROI [" << roi.begin[0] << ":" << roi.end[0] << ", " << roi.begin[1] << ":" << roi.end[1]
+                  << ", " << roi.begin[2] << ":" << roi.end[2] << "]" << std::endl;
+    }
+    std::cout << "Downsample " << result.timing.downsample_ms << " ms  localize " << result.timing.localize_ms
+              << " ms  roi " << result.timing.roi_ms << " ms  refine " << result.timing.refine_ms
+              << " ms  total " << result.timing.total_ms << " ms" << std::endl;
+    return result;
+}
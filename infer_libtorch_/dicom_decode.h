@@ -0,0 +1,304 @@
+#pragma once
+
+#include "itkImage.h"
+#include "gdcmImageReader.h"
+#include "gdcmReader.h"
+#include "gdcmStringFilter.h"
+#include "gdcmTransferSyntax.h"
+#include "read_ahead.h"
+#include "parallel_tasks.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <istream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// 只读取到像素数据之前的头信息: 传输语法以及切片布局
+struct DicomSliceLayout
+{
+    gdcm::TransferSyntax ts;
+    unsigned int frames = 1;  // Number of Frames (0028,0008), 增强型多帧文件大于 1
+    unsigned int samples = 1; // Samples per Pixel (0028,0002), 彩色图像为 3
+    std::string photometric;  // Photometric Interpretation (0028,0004)
+
+    // ParallelDecodeSeries 只处理单帧、单通道 MONOCHROME2 切片, 其余交给 ITK 读取
+    bool ParallelDecodable() const { return frames == 1 && samples == 1 && photometric == "MONOCHROME2"; }
+};
+
+inline DicomSliceLayout DetectSliceLayout(const std::string &fileName)
+{
+    gdcm::Reader reader;
+    reader.SetFileName(fileName.c_str());
+    if (!reader.ReadUpToTag(gdcm::Tag(0x7fe0, 0x0010)))
+    {
+        throw std::runtime_error("Cannot read DICOM header: " + fileName);
+    }
+    gdcm::StringFilter filter;
+    filter.SetFile(reader.GetFile());
+
+    auto trimmed = [&](uint16_t group, uint16_t element)
+    {
+        std::string value = filter.ToString(gdcm::Tag(group, element));
+        value.erase(0, value.find_first_not_of(' '));
+        value.erase(value.find_last_not_of(std::string(" \0", 2)) + 1);
+        return value;
+    };
+    auto count = [&](uint16_t group, uint16_t element)
+    {
+        std::string value = trimmed(group, element);
+        try
+        {
+            return value.empty() ? 1u : static_cast<unsigned int>(std::stoul(value));
+        }
+        catch (const std::exception &)
+        {
+            return 1u;
+        }
+    };
+
+    DicomSliceLayout layout;
+    layout.ts = reader.GetFile().GetHeader().GetDataSetTransferSyntax();
+    layout.frames = count(0x0028, 0x0008);
+    layout.samples = count(0x0028, 0x0002);
+    layout.photometric = trimmed(0x0028, 0x0004);
+    return layout;
+}
+
+// 只读取到像素数据之前, 获取文件的传输语法
+inline gdcm::TransferSyntax DetectTransferSyntax(const std::string &fileName)
+{
+    return DetectSliceLayout(fileName).ts;
+}
+
+// JPEG-Lossless / JPEG-LS / JPEG2000 / RLE 等封装 (压缩) 传输语法
+inline bool IsCompressedTransferSyntax(const gdcm::TransferSyntax &ts)
+{
+    return ts.IsEncapsulated();
+}
+
+inline std::string TransferSyntaxName(const gdcm::TransferSyntax &ts)
+{
+    const char *name = gdcm::TransferSyntax::GetTSString(ts);
+    return name ? name : "Unknown";
+}
+
+namespace detail
+{
+    // 按 slope / intercept 将存储值转换为目标像素类型, 超出范围时截断
+    template <typename TStored, typename TPixel>
+    void RescaleSlice(const char *src, TPixel *dst, size_t count, double slope, double intercept)
+    {
+        const TStored *in = reinterpret_cast<const TStored *>(src);
+        const double lo = static_cast<double>(std::numeric_limits<TPixel>::lowest());
+        const double hi = static_cast<double>(std::numeric_limits<TPixel>::max());
+        for (size_t i = 0; i < count; ++i)
+        {
+            double v = static_cast<double>(in[i]) * slope + intercept;
+            dst[i] = static_cast<TPixel>(std::min(hi, std::max(lo, v)));
+        }
+    }
+
+    template <typename TPixel>
+    bool StoredTypeMatches(gdcm::PixelFormat::ScalarType type)
+    {
+        switch (type)
+        {
+        case gdcm::PixelFormat::INT8:
+            return std::is_same<TPixel, int8_t>::value;
+        case gdcm::PixelFormat::UINT8:
+            return std::is_same<TPixel, uint8_t>::value;
+        case gdcm::PixelFormat::INT16:
+            return std::is_same<TPixel, int16_t>::value;
+        case gdcm::PixelFormat::UINT16:
+            return std::is_same<TPixel, uint16_t>::value;
+        case gdcm::PixelFormat::INT32:
+            return std::is_same<TPixel, int32_t>::value;
+        case gdcm::PixelFormat::UINT32:
+            return std::is_same<TPixel, uint32_t>::value;
+        default:
+            return false;
+        }
+    }
+
+    // 解码单个切片到目标缓冲区; 存储类型一致且无需 rescale 时直接解码到目标位置
+    // fileData 非空时从预读的内存缓冲区解析, 否则直接读文件
+    template <typename TPixel>
+    void DecodeSlice(const std::string &fileName, std::vector<char> *fileData, TPixel *dst, size_t sliceElements, std::vector<char> &scratch)
+    {
+        gdcm::ImageReader reader;
+        MemoryStreamBuf streamBuf(fileData ? fileData->data() : nullptr, fileData ? fileData->size() : 0);
+        std::istream stream(&streamBuf);
+        if (fileData)
+            reader.SetStream(stream);
+        else
+            reader.SetFileName(fileName.c_str());
+        if (!reader.Read())
+        {
+            throw std::runtime_error("Cannot read DICOM file: " + fileName);
+        }
+
+        const gdcm::Image &img = reader.GetImage();
+        const gdcm::PixelFormat &pf = img.GetPixelFormat();
+        // 多帧文件的缓冲区包含所有帧, 只取第一帧会静默丢失数据
+        const size_t length = img.GetBufferLength();
+        if (pf.GetSamplesPerPixel() != 1 || static_cast<size_t>(img.GetDimension(0)) * img.GetDimension(1) != sliceElements ||
+            (img.GetNumberOfDimensions() > 2 && img.GetDimension(2) != 1) || length != sliceElements * pf.GetPixelSize())
+        {
+            throw std::runtime_error("Unexpected slice layout in: " + fileName);
+        }
+
+        const double slope = img.GetSlope();
+        const double intercept = img.GetIntercept();
+
+        if (StoredTypeMatches<TPixel>(pf.GetScalarType()) && slope == 1.0 && intercept == 0.0 &&
+            length == sliceElements * sizeof(TPixel))
+        {
+            if (!img.GetBuffer(reinterpret_cast<char *>(dst)))
+            {
+                throw std::runtime_error("Cannot decode pixel data: " + fileName);
+            }
+            return;
+        }
+
+        scratch.resize(length);
+        if (!img.GetBuffer(scratch.data()))
+        {
+            throw std::runtime_error("Cannot decode pixel data: " + fileName);
+        }
+
+        switch (pf.GetScalarType())
+        {
+        case gdcm::PixelFormat::INT8:
+            RescaleSlice<int8_t>(scratch.data(), dst, sliceElements, slope, intercept);
+            break;
+        case gdcm::PixelFormat::UINT8:
+            RescaleSlice<uint8_t>(scratch.data(), dst, sliceElements, slope, intercept);
+            break;
+        case gdcm::PixelFormat::INT16:
+            RescaleSlice<int16_t>(scratch.data(), dst, sliceElements, slope, intercept);
+            break;
+        case gdcm::PixelFormat::UINT16:
+            RescaleSlice<uint16_t>(scratch.data(), dst, sliceElements, slope, intercept);
+            break;
+        case gdcm::PixelFormat::INT32:
+            RescaleSlice<int32_t>(scratch.data(), dst, sliceElements, slope, intercept);
+            break;
+        case gdcm::PixelFormat::UINT32:
+            RescaleSlice<uint32_t>(scratch.data(), dst, sliceElements, slope, intercept);
+            break;
+        default:
+            throw std::runtime_error("Unsupported pixel format in: " + fileName);
+        }
+    }
+}
+
+// 并行解码一个已排序的 DICOM 序列 (fileNames 为 GDCMSeriesFileNames 的输出顺序)
+// 每个文件须为单帧单通道切片 (见 DicomSliceLayout::ParallelDecodable)
+// 每个线程持有自己的 gdcm 解码器, 第 i 个文件直接写入体数据的第 i 个切片
+// readAhead 非空时文件内容由预读队列提供
+template <typename TPixel>
+typename itk::Image<TPixel, 3>::Pointer ParallelDecodeSeries(const std::vector<std::string> &fileNames, unsigned int numThreads = 0,
+                                                             DicomReadAhead *readAhead = nullptr)
+{
+    using ImageType = itk::Image<TPixel, 3>;
+
+    if (fileNames.empty())
+    {
+        throw std::runtime_error("Empty DICOM file list.");
+    }
+
+    // 几何信息取自首尾两个切片
+    gdcm::ImageReader firstReader;
+    firstReader.SetFileName(fileNames.front().c_str());
+    if (!firstReader.Read())
+    {
+        throw std::runtime_error("Cannot read DICOM file: " + fileNames.front());
+    }
+    const gdcm::Image &first = firstReader.GetImage();
+    const double *firstOrigin = first.GetOrigin();
+    const double *pixelSpacing = first.GetSpacing();
+    const double *cosines = first.GetDirectionCosines();
+
+    typename ImageType::SizeType size;
+    size[0] = first.GetDimension(0);
+    size[1] = first.GetDimension(1);
+    size[2] = fileNames.size();
+
+    double row[3] = {cosines[0], cosines[1], cosines[2]};
+    double col[3] = {cosines[3], cosines[4], cosines[5]};
+    double normal[3] = {row[1] * col[2] - row[2] * col[1],
+                        row[2] * col[0] - row[0] * col[2],
+                        row[0] * col[1] - row[1] * col[0]};
+    double sliceSpacing = pixelSpacing[2] > 0.0 ? pixelSpacing[2] : 1.0;
+
+    if (fileNames.size() > 1)
+    {
+        gdcm::ImageReader lastReader;
+        lastReader.SetFileName(fileNames.back().c_str());
+        if (!lastReader.Read())
+        {
+            throw std::runtime_error("Cannot read DICOM file: " + fileNames.back());
+        }
+        const double *lastOrigin = lastReader.GetImage().GetOrigin();
+        double step[3];
+        double length = 0.0;
+        for (int i = 0; i < 3; ++i)
+        {
+            step[i] = (lastOrigin[i] - firstOrigin[i]) / (fileNames.size() - 1);
+            length += step[i] * step[i];
+        }
+        length = std::sqrt(length);
+        if (length > 0.0)
+        {
+            // 与 ForceOrthogonalDirectionOff 一致, 第三个方向取切片位置的实际走向 (gantry tilt)
+            sliceSpacing = length;
+            for (int i = 0; i < 3; ++i)
+                normal[i] = step[i] / length;
+        }
+    }
+
+    typename ImageType::SpacingType spacing;
+    spacing[0] = pixelSpacing[0];
+    spacing[1] = pixelSpacing[1];
+    spacing[2] = sliceSpacing;
+
+    typename ImageType::PointType origin;
+    typename ImageType::DirectionType direction;
+    for (int i = 0; i < 3; ++i)
+    {
+        origin[i] = firstOrigin[i];
+        direction[i][0] = row[i];
+        direction[i][1] = col[i];
+        direction[i][2] = normal[i];
+    }
+
+    typename ImageType::RegionType region;
+    region.SetSize(size);
+    auto image = ImageType::New();
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+    image->Allocate();
+
+    const size_t sliceElements = size[0] * size[1];
+    TPixel *buffer = image->GetBufferPointer();
+
+    // 每个线程持有自己的 scratch 缓冲, 第 i 个文件直接写入第 i 个切片
+    std::vector<std::vector<char>> scratch(numThreads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : numThreads);
+    ParallelForEachIndex(fileNames.size(), static_cast<unsigned int>(scratch.size()), [&](size_t i, unsigned int t)
+                         {
+                             std::vector<char> fileData;
+                             if (readAhead)
+                                 fileData = readAhead->Take(i);
+                             detail::DecodeSlice<TPixel>(fileNames[i], readAhead ? &fileData : nullptr, buffer + i * sliceElements, sliceElements, scratch[t]); });
+
+    return image;
+}
@@ -11,15 +11,37 @@
 #include <cstring> // for strdup
 #include <cstdlib> // for free
 #include <cxxabi.h>
-#include <Eigen/Dense>
-
-// 定义影像类型
+#include <thread>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <type_traits>
+#include "dicom_decode.h"
+#include "pixel_dispatch.h"
+#include "multi_model.h"
+#include "slice_batch.h"
+#include "cascade.h"
+#include "result_cache.h"
+#include "admission.h"
+#include "mmap_weights.h"
+
+// 定义影像类型 (默认 CT); 其它模态根据 DICOM 头信息分派到对应像素类型的模板实例
 using PixelType = signed short;
 constexpr unsigned int Dimension = 3;
 using ImageType = itk::Image<PixelType, Dimension>;
 
-// 读取 DICOM 系列文件的函数
-std::tuple<std::vector<PixelType>, ImageType::SpacingType, ImageType::PointType, ImageType::SizeType, ImageType::DirectionType> ITKLoadDICOMSeries(const std::string &dirName, const std::string &seriesIdentifier = "")
+// 读取 DICOM 系列的结果: 像素数据、spacing、origin、size、direction
+template <typename TPixel, unsigned int VDimension = Dimension>
+using DICOMSeriesData = std::tuple<std::vector<TPixel>,
+                                   typename itk::Image<TPixel, VDimension>::SpacingType,
+                                   typename itk::Image<TPixel, VDimension>::PointType,
+                                   typename itk::Image<TPixel, VDimension>::SizeType,
+                                   typename itk::Image<TPixel, VDimension>::DirectionType>;
+
+// 获取 DICOM 系列排好序的文件列表 (只解析头信息, 不解码像素)
+std::vector<std::string> ITKGetDICOMSeriesFileNames(const std::string &dirName, const std::string &seriesIdentifier = "")
 {
     using NamesGeneratorType = itk::GDCMSeriesFileNames;
     auto nameGenerator = NamesGeneratorType::New();
@@ -35,42 +57,100 @@ std::tuple<std::vector<PixelType>, ImageType::SpacingType, ImageType::PointType,
         const SeriesIdContainer &seriesUID = nameGenerator->GetSeriesUIDs();
         auto seriesItr = seriesUID.begin();
         auto seriesEnd = seriesUID.end();
-        std::cout << "Series " << *seriesItr << std::endl;
 
         if (seriesItr == seriesEnd)
         {
             std::cerr << "No DICOMs in: " << dirName << std::endl;
             throw std::runtime_error("No DICOMs found in the specified directory.");
         }
+        std::cout << "Series " << *seriesItr << std::endl;
 
         std::cout << "Reading series: " << seriesIdentifier << std::endl;
 
         using FileNamesContainer = std::vector<std::string>;
         FileNamesContainer fileNames = nameGenerator->GetFileNames(*seriesItr);
+        return fileNames;
+    }
+    catch (itk::ExceptionObject &excp)
+    {
+        std::cerr << "ExceptionObject caught: " << excp << std::endl;
+        throw;
+    }
+}
+
+// 解码排好序的 DICOM 文件列表, 直接得到 TPixel 类型的像素 (rescale 在解码时完成)
+template <typename TPixel, unsigned int VDimension = Dimension>
+DICOMSeriesData<TPixel, VDimension> ITKLoadDICOMFiles(const std::vector<std::string> &fileNames, const ReadAheadOptions &readAhead = ReadAheadOptions())
+{
+    using SeriesImageType = itk::Image<TPixel, VDimension>;
+
+    try
+    {
+        typename SeriesImageType::Pointer image;
+
+        // 压缩传输语法 (JPEG-Lossless / JPEG-LS / JPEG2000 / RLE) 使用多线程解码
+        // 多帧、彩色等并行解码不支持的布局仍由 ITK 读取
+        DicomSliceLayout layout = DetectSliceLayout(fileNames.front());
+        std::cout << "Transfer syntax: " << TransferSyntaxName(layout.ts) << std::endl;
+        bool decoded = false;
+        if constexpr (VDimension == 3)
+        {
+            if (!layout.ParallelDecodable())
+            {
+                std::cout << "Slice layout (" << layout.frames << " frames, " << layout.samples << " samples, "
+                          << layout.photometric << ") not supported by parallel decode, using ITK reader." << std::endl;
+            }
+            else if (readAhead.enabled)
+            {
+                // 预读模式: 多个读请求同时在途, 解码器直接解析内存中的文件内容
+                DicomReadAhead prefetch(fileNames, readAhead);
+                std::cout << "Read-ahead backend: " << (prefetch.UsingUring() ? "io_uring" : "thread pool") << std::endl;
+                image = ParallelDecodeSeries<TPixel>(fileNames, 0, &prefetch);
+                decoded = true;
+            }
+            else if (IsCompressedTransferSyntax(layout.ts))
+            {
+                image = ParallelDecodeSeries<TPixel>(fileNames);
+                decoded = true;
+            }
+        }
 
-        using ReaderType = itk::ImageSeriesReader<ImageType>;
-        auto reader = ReaderType::New();
-        using ImageIOType = itk::GDCMImageIO;
-        auto dicomIO = ImageIOType::New();
-        reader->SetImageIO(dicomIO);
-        reader->SetFileNames(fileNames);
-        reader->ForceOrthogonalDirectionOff(); // properly read CTs with gantry tilt
+        if (!decoded)
+        {
+            using ReaderType = itk::ImageSeriesReader<SeriesImageType>;
+            auto reader = ReaderType::New();
+            using ImageIOType = itk::GDCMImageIO;
+            auto dicomIO = ImageIOType::New();
+            reader->SetImageIO(dicomIO);
+            reader->SetFileNames(fileNames);
+            reader->ForceOrthogonalDirectionOff(); // properly read CTs with gantry tilt
 
-        reader->Update();
+            reader->Update();
 
-        ImageType::Pointer image = reader->GetOutput();
-        ImageType::SizeType size = image->GetLargestPossibleRegion().GetSize();
-        ImageType::SpacingType spacing = image->GetSpacing();
-        ImageType::PointType origin = image->GetOrigin();
-        ImageType::DirectionType direction = image->GetDirection();
+            image = reader->GetOutput();
+        }
+
+        typename SeriesImageType::SizeType size = image->GetLargestPossibleRegion().GetSize();
+        typename SeriesImageType::SpacingType spacing = image->GetSpacing();
+        typename SeriesImageType::PointType origin = image->GetOrigin();
+        typename SeriesImageType::DirectionType direction = image->GetDirection();
 
-        std::vector<PixelType> imageData(size[0] * size[1] * size[2]);
+        std::vector<TPixel> imageData(image->GetLargestPossibleRegion().GetNumberOfPixels());
         std::copy(image->GetBufferPointer(), image->GetBufferPointer() + imageData.size(), imageData.begin());
 
         // 打印 spacing 和 origin
-        std::cout << "Spacing: " << spacing[0] << "  " << spacing[1] << "  " << spacing[2] << std::endl;
-        std::cout << "Origin: " << origin[0] << "  " << origin[1] << "  " << origin[2] << std::endl;
-        std::cout << "Dims: " << " size 0 " << size[0] << "  size 1 " << size[1] << "  size 2 " << size[2] << std::endl;
+        std::cout << "Spacing:";
+        for (unsigned int d = 0; d < VDimension; ++d)
+            std::cout << "  " << spacing[d];
+        std::cout << std::endl
+                  << "Origin:";
+        for (unsigned int d = 0; d < VDimension; ++d)
+            std::cout << "  " << origin[d];
+        std::cout << std::endl
+                  << "Dims: ";
+        for (unsigned int d = 0; d < VDimension; ++d)
+            std::cout << " size " << d << " " << size[d] << " ";
+        std::cout << std::endl;
 
         return std::make_tuple(imageData, spacing, origin, size, direction);
     }
@@ -81,24 +161,58 @@ std::tuple<std::vector<PixelType>, ImageType::SpacingType, ImageType::PointType,
     }
 }
 
-// 将影像数据转换为 PyTorch 张量
-torch::Tensor ConvertToTensor(const std::vector<float> &imageData, const itk::Size<3> &dims)
+// 读取 DICOM 系列文件的函数
+template <typename TPixel = PixelType, unsigned int VDimension = Dimension>
+DICOMSeriesData<TPixel, VDimension> ITKLoadDICOMSeries(const std::string &dirName, const std::string &seriesIdentifier = "", const ReadAheadOptions &readAhead = ReadAheadOptions())
 {
-    torch::TensorOptions options = torch::TensorOptions().dtype(torch::kFloat32);
-
-    // 创建张量并按 Z, Y, X 顺序加载数据
-    torch::Tensor image_tensor = torch::from_blob(
-        (void *)imageData.data(),
-        {static_cast<int>(dims[2]), static_cast<int>(dims[1]), static_cast<int>(dims[0])},
-        options);
+    return ITKLoadDICOMFiles<TPixel, VDimension>(ITKGetDICOMSeriesFileNames(dirName, seriesIdentifier), readAhead);
+}
 
-    // 使用 permute 调整张量维度顺序为 (X, Y, Z)
-    torch::Tensor permuted_tensor = image_tensor.permute({2, 1, 0}).clone();
+// 将影像数据转换为 PyTorch 张量
+// 类型转换、逐元素变换 transform 和 (Z, Y, X) -> (X, Y, Z) 的维度重排在同一遍中完成, 不生成中间拷贝
+template <typename TPixel, unsigned int VDimension, typename TTransform>
+torch::Tensor ConvertToTensor(const std::vector<TPixel> &imageData, const itk::Size<VDimension> &dims, TTransform transform)
+{
+    // ITK 缓冲区中第 0 维变化最快
+    std::vector<int64_t> shape(VDimension);
+    std::vector<int64_t> inStride(VDimension);
+    int64_t stride = 1;
+    for (unsigned int d = 0; d < VDimension; ++d)
+    {
+        shape[d] = static_cast<int64_t>(dims[d]);
+        inStride[d] = stride;
+        stride *= shape[d];
+    }
 
-    std::cout << "Tensor Shape: " << permuted_tensor.sizes() << std::endl;
+    torch::Tensor tensor = torch::empty(shape, torch::TensorOptions().dtype(torch::kFloat32));
+    float *out = tensor.data_ptr<float>();
+    const TPixel *in = imageData.data();
+
+    // 输出为行优先排列, 最后一维连续; 按输出行并行
+    const int64_t inner = shape[VDimension - 1];
+    const int64_t innerStride = inStride[VDimension - 1];
+    const int64_t rows = inner > 0 ? tensor.numel() / inner : 0;
+    at::parallel_for(0, rows, 16, [&](int64_t begin, int64_t end)
+                     {
+                         for (int64_t r = begin; r < end; ++r)
+                         {
+                             int64_t rem = r;
+                             int64_t base = 0;
+                             for (int d = static_cast<int>(VDimension) - 2; d >= 0; --d)
+                             {
+                                 base += (rem % shape[d]) * inStride[d];
+                                 rem /= shape[d];
+                             }
+                             float *dst = out + r * inner;
+                             const TPixel *src = in + base;
+                             for (int64_t k = 0; k < inner; ++k)
+                                 dst[k] = transform(src[k * innerStride]);
+                         } });
+
+    std::cout << "Tensor Shape: " << tensor.sizes() << std::endl;
     std::cout << std::endl;
 
-    return permuted_tensor;
+    return tensor;
 }
 
 // 解码类型名称
@@ -119,132 +233,435 @@ std::string demangle(const char *mangled_name)
     }
 }
 
-// HU值转换为uint8
-std::vector<float> HU2uint8(const std::vector<PixelType> &image, const itk::Size<3> &size, float HU_min = -1024.0, float HU_max = 300.0, float HU_nan = -2000.0)
+// HU值转换为uint8: 加窗并归一化到 [0, 1], 由 TPixel 直接转换为 float 张量
+template <typename TPixel, unsigned int VDimension>
+torch::Tensor HU2uint8(const std::vector<TPixel> &image, const itk::Size<VDimension> &size, float HU_min = -1024.0, float HU_max = 300.0, float HU_nan = -2000.0)
 {
-    // 计算总元素数量
-    size_t total_elements = size[0] * size[1] * size[2];
+    const float scale = 1.0f / (HU_max - HU_min);
+    return ConvertToTensor(image, size, [=](TPixel v)
+                           {
+                               float x = static_cast<float>(v);
+                               // 只有浮点像素可能是 NaN, 替换为 HU_nan
+                               if constexpr (std::is_floating_point<TPixel>::value)
+                               {
+                                   if (std::isnan(x))
+                                       x = HU_nan;
+                               }
+                               return std::min(1.0f, std::max(0.0f, (x - HU_min) * scale)); });
+}
 
-    // 创建一个 float 类型的向量来存储转换后的数据
-    std::vector<float> image_float(total_elements);
+// 将 HU 数据直接转换为 [1, 1, X, Y, Z] 的 float32 张量, 供多模型共享
+template <typename TPixel, unsigned int VDimension>
+torch::Tensor ConvertToHUTensor(const std::vector<TPixel> &imageData, const itk::Size<VDimension> &dims)
+{
+    return ConvertToTensor(imageData, dims, [](TPixel v)
+                           { return static_cast<float>(v); })
+        .unsqueeze(0)
+        .unsqueeze(0);
+}
 
-    // 将 short int 类型的数据转换为 float 类型
-    for (size_t i = 0; i < total_elements; ++i)
+// 命令行开关, 例如 --multi
+bool HasFlag(int argc, const char *argv[], const std::string &flag)
+{
+    for (int i = 3; i < argc; ++i)
     {
-        image_float[i] = static_cast<float>(image[i]);
+        if (flag == argv[i])
+            return true;
     }
+    return false;
+}
 
-    // 将输入的 std::vector<float> 映射为 Eigen::MatrixXf
-    Eigen::Map<Eigen::MatrixXf> image_matrix(image_float.data(), total_elements, 1);
-
-    // 使用 unaryExpr 对每个元素进行操作，将 NaN 值替换为 HU_nan
-    image_matrix = image_matrix.unaryExpr([HU_nan](float x)
-                                          { return std::isnan(x) ? HU_nan : x; });
-
-    // 将 HU 值归一化到 [0, 1] 范围内
-    image_matrix.array() = (image_matrix.array() - HU_min) / (HU_max - HU_min);
+// 命令行参数值, 例如 --cores 8
+std::string GetOption(int argc, const char *argv[], const std::string &name, const std::string &defaultValue)
+{
+    for (int i = 3; i + 1 < argc; ++i)
+    {
+        if (name == argv[i])
+            return argv[i + 1];
+    }
+    return defaultValue;
+}
 
-    // 使用 cwiseMax 和 cwiseMin 将所有值限制在 [0, 1] 范围内
-    image_matrix = image_matrix.cwiseMax(0.0f).cwiseMin(1.0f);
+// 解码之前确定的运行参数, 传给各像素类型的 RunStudy 实例
+struct StudyContext
+{
+    int argc = 0;
+    const char **argv = nullptr;
+    std::string modelPath;
+    std::vector<std::string> fileNames;
+    ReadAheadOptions readAhead;
+    ResultCache *cache = nullptr;
+    std::string cacheKey;
+    std::optional<torch::jit::IValue> cachedOutput;
+    PatchPlan patchPlan;
+};
+
+// 加载预训练模型; 指定 --mmap-weights 时权重以只读方式映射, 同一主机上的进程共享
+inline bool LoadStudyModule(const StudyContext &ctx, torch::jit::script::Module &module, torch::Device &device)
+{
+    std::string weightsDir = GetOption(ctx.argc, ctx.argv, "--mmap-weights", "");
+    auto loadStart = std::chrono::steady_clock::now();
+    try
+    {
+        module = weightsDir.empty() ? torch::jit::load(ctx.modelPath) : LoadMappedModule(ctx.modelPath, weightsDir);
+    }
+    catch (const c10::Error &e)
+    {
+        std::cerr << "Error loading the module\n";
+        return false;
+    }
+    module.eval();
 
-    // 创建一个 std::vector<float> 来存储结果
-    std::vector<float> result(total_elements);
+    std::cout << "Model loaded successfully in "
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count() << " ms.\n";
 
-    // 将处理后的数据从 Eigen::MatrixXf 复制到 std::vector<float> 中
-    for (size_t i = 0; i < total_elements; ++i)
+    torch::DeviceType device_type;
+    if (torch::cuda::is_available())
     {
-        result[i] = image_matrix(i, 0);
+        std::cout << "CUDA available! Running on GPU." << std::endl;
+        device_type = torch::kCUDA;
     }
+    else
+    {
+        std::cout << "Running on CPU." << std::endl;
+        device_type = torch::kCPU;
+    }
+
+    device = torch::Device(device_type);
 
-    return result;
+    module.to(device);
+    return true;
 }
-int main(int argc, const char *argv[])
+
+// 分块执行的结果不写入缓存 (序列化全尺寸输出会抵消内存预算), 缓存命中也不做校验
+inline void ReportPatchCacheBypass(const StudyContext &ctx)
 {
-    if (argc < 3)
+    if (ctx.cache)
     {
-        std::cerr << "Usage: " << argv[0] << " <directory> <path-to-exported-script-module>\n";
-        return -1;
+        std::cout << "Result cache bypassed for patch execution"
+                  << (ctx.cachedOutput ? " (cached result not verified)." : " (result not stored).") << std::endl;
     }
+}
 
-    std::string dirName = argv[1];
-    std::string modelPath = argv[2];
+// 加载、预处理并推理一个序列; TPixel 由 DICOM 头信息在运行时分派
+template <typename TPixel>
+int RunStudy(StudyContext &ctx)
+{
+    const int argc = ctx.argc;
+    const char **argv = ctx.argv;
+    const std::string &modelPath = ctx.modelPath;
 
-    try
+    // 流式分块执行: 连解码后的整个序列也放不下, 每块只解码其覆盖的切片
+    if (ctx.patchPlan.streaming)
+    {
+        torch::jit::script::Module module;
+        torch::Device device(torch::kCPU);
+        if (!LoadStudyModule(ctx, module, device))
+        {
+            return -1;
+        }
+        torch::jit::getProfilingMode() = false;
+        torch::Tensor output = RunStreamingPatchInference<TPixel>(module, ctx.fileNames, ctx.patchPlan.size, ctx.patchPlan, device);
+        std::cout << "Patch execution output shape: " << output.sizes() << std::endl;
+        ReportPatchCacheBypass(ctx);
+        std::cout << "Inference completed." << std::endl;
+        return 0;
+    }
+
+    // 读取 DICOM 系列文件
+    auto [imageData, spacing, origin, size, direction] = ITKLoadDICOMFiles<TPixel>(ctx.fileNames, ctx.readAhead);
+
+    // 打印一些信息
+    std::cout << "Image data size: " << imageData.size() << std::endl;
+    std::cout << "Spacing: " << spacing[0] << "  " << spacing[1] << "  " << spacing[2] << std::endl;
+    std::cout << "Origin: " << origin[0] << "  " << origin[1] << "  " << origin[2] << std::endl;
+    std::cout << "Size: " << " size 0 " << size[0] << "  size 1 " << size[1] << "  size 2 " << size[2] << std::endl;
+    std::cout << "imageData type: " << demangle(typeid(imageData).name()) << std::endl;
+    std::cout << "spacing type: " << demangle(typeid(spacing).name()) << std::endl;
+    std::cout << "origin type: " << demangle(typeid(origin).name()) << std::endl;
+    std::cout << "size type: " << demangle(typeid(size).name()) << std::endl;
+    std::cout << "direction type: " << demangle(typeid(direction).name()) << std::endl;
+    std::cout << "Direction matrix:" << std::endl;
+    for (unsigned int i = 0; i < 3; ++i)
     {
-        // 读取 DICOM 系列文件
-        auto [imageData, spacing, origin, size, direction] = ITKLoadDICOMSeries(dirName);
-
-        // 打印一些信息
-        std::cout << "Image data size: " << imageData.size() << std::endl;
-        std::cout << "Spacing: " << spacing[0] << "  " << spacing[1] << "  " << spacing[2] << std::endl;
-        std::cout << "Origin: " << origin[0] << "  " << origin[1] << "  " << origin[2] << std::endl;
-        std::cout << "Size: " << " size 0 " << size[0] << "  size 1 " << size[1] << "  size 2 " << size[2] << std::endl;
-        std::cout << "imageData type: " << demangle(typeid(imageData).name()) << std::endl;
-        std::cout << "spacing type: " << demangle(typeid(spacing).name()) << std::endl;
-        std::cout << "origin type: " << demangle(typeid(origin).name()) << std::endl;
-        std::cout << "size type: " << demangle(typeid(size).name()) << std::endl;
-        std::cout << "direction type: " << demangle(typeid(direction).name()) << std::endl;
-        std::cout << "Direction matrix:" << std::endl;
-        for (unsigned int i = 0; i < 3; ++i)
+        for (unsigned int j = 0; j < 3; ++j)
         {
-            for (unsigned int j = 0; j < 3; ++j)
-            {
-                std::cout << direction[i][j] << " ";
-            }
-            std::cout << std::endl;
+            std::cout << direction[i][j] << " ";
         }
+        std::cout << std::endl;
+    }
 
-        // 预处理影像数据
-        std::vector<float> floatImageData = HU2uint8(imageData, size);
+    // 多模型模式: DICOM 只解码一次, 各模型的输入由共享的中间结果派生
+    if (HasFlag(argc, argv, "--multi"))
+    {
+        std::vector<ModelSpec> specs = LoadModelSpecs(modelPath);
+        int cores = std::stoi(GetOption(argc, argv, "--cores", std::to_string(std::max(1u, std::thread::hardware_concurrency()))));
+        torch::Device device(torch::cuda::is_available() ? torch::kCUDA : torch::kCPU);
 
-        // 将影像数据转换为 PyTorch 张量
-        torch::Tensor tensorImage = ConvertToTensor(floatImageData, size);
+        torch::Tensor huTensor = ConvertToHUTensor(imageData, size);
+        auto results = RunMultiModel(huTensor, {spacing[0], spacing[1], spacing[2]}, specs, cores, device);
 
-        // 加载预训练模型
-        torch::jit::script::Module module;
+        std::cout << "Inference completed for " << results.size() << " models." << std::endl;
+        return 0;
+    }
+
+    torch::jit::script::Module module;
+    torch::Device device(torch::kCPU);
+    if (!LoadStudyModule(ctx, module, device))
+    {
+        return -1;
+    }
+
+    // 内存不足以整体执行时, 沿 Z 方向分块加窗和推理, 不生成整幅 float 中间结果
+    if (ctx.patchPlan.slab > 0)
+    {
+        torch::jit::getProfilingMode() = false;
+        int64_t dims[3] = {static_cast<int64_t>(size[0]), static_cast<int64_t>(size[1]), static_cast<int64_t>(size[2])};
+        torch::Tensor output = RunPatchInference(module, imageData, dims, ctx.patchPlan, device);
+        std::cout << "Patch execution output shape: " << output.sizes() << std::endl;
+        ReportPatchCacheBypass(ctx);
+        std::cout << "Inference completed." << std::endl;
+        return 0;
+    }
+
+    // 预处理影像数据并转换为 PyTorch 张量
+    torch::Tensor tensorImage = HU2uint8(imageData, size);
+
+    // 2D 模式: 按切片方向以 [N, C, H, W] 批量推理, 结果重组回体数据
+    if (HasFlag(argc, argv, "--slice2d"))
+    {
+        SliceBatchOptions sliceOptions;
+        sliceOptions.axis = std::stoi(GetOption(argc, argv, "--axis", "2"));
+        sliceOptions.context = std::stoi(GetOption(argc, argv, "--context", "0"));
+        sliceOptions.batch_size = std::stoi(GetOption(argc, argv, "--batch", "16"));
+
+        torch::jit::getProfilingMode() = false;
+        SliceBatchResult result = RunSliceBatchInference(module, tensorImage, sliceOptions, device);
+        if (result.volume.defined())
+            std::cout << "Prediction volume shape: " << result.volume.sizes() << std::endl;
+        if (result.per_slice.defined())
+            std::cout << "Per-slice prediction shape: " << result.per_slice.sizes() << std::endl;
+
+        std::cout << "Inference completed." << std::endl;
+        return 0;
+    }
+
+    // 级联模式: 低分辨率定位模型找 ROI, 全分辨率模型 (第二个参数) 只在 ROI 上运行
+    std::string localizerPath = GetOption(argc, argv, "--cascade", "");
+    if (!localizerPath.empty())
+    {
+        CascadeOptions cascadeOptions;
+        cascadeOptions.localizer_path = localizerPath;
+        cascadeOptions.coarse_spacing = std::stod(GetOption(argc, argv, "--coarse-spacing", "4.0"));
+        cascadeOptions.threshold = std::stod(GetOption(argc, argv, "--roi-threshold", "0.5"));
+        cascadeOptions.margin_mm = std::stod(GetOption(argc, argv, "--roi-margin-mm", "10.0"));
+
+        torch::jit::script::Module localizer;
         try
         {
-            module = torch::jit::load(modelPath);
+            localizer = torch::jit::load(cascadeOptions.localizer_path);
         }
         catch (const c10::Error &e)
         {
-            std::cerr << "Error loading the module\n";
+            std::cerr << "Error loading the localizer module\n";
             return -1;
         }
-        module.eval();
+        localizer.eval();
+        localizer.to(device);
 
-        std::cout << "Model loaded successfully.\n";
+        torch::jit::getProfilingMode() = false;
+        CascadeResult result = RunCascadeInference(localizer, module, tensorImage, {spacing[0], spacing[1], spacing[2]}, cascadeOptions, device);
+        if (result.output.defined())
+            std::cout << "Prediction volume shape: " << result.output.sizes() << std::endl;
+        else
+            std::cout << "No region found by the localizer." << std::endl;
+
+        std::cout << "Inference completed." << std::endl;
+        return 0;
+    }
 
-        torch::DeviceType device_type;
-        if (torch::cuda::is_available())
+    // 将输入张量移动到与模型相同的设备上
+    tensorImage = tensorImage.to(device);
+
+    // 准备输入数据
+    std::vector<torch::jit::IValue> inputs;
+    tensorImage = tensorImage.unsqueeze(0).unsqueeze(0); // 形状变为 [1, 1, depth, height, width]
+    inputs.push_back(tensorImage);
+
+    // 执行模型推理
+    torch::NoGradGuard no_grad;
+    torch::jit::getProfilingMode() = false;
+    auto output = module.forward(inputs);
+
+    // 缓存命中后抽样重新计算的结果与缓存比较; 未命中时写入缓存
+    if (ctx.cache)
+    {
+        if (ctx.cachedOutput)
         {
-            std::cout << "CUDA available! Running on GPU." << std::endl;
-            device_type = torch::kCUDA;
+            bool match = SameInferenceResult(*ctx.cachedOutput, output);
+            ctx.cache->RecordVerification(match);
+            std::cout << "Cache verification: " << (match ? "match" : "MISMATCH, replacing the cached result") << std::endl;
+            // 不一致时以重新计算的结果覆盖, 不再返回过期的缓存
+            if (!match)
+                ctx.cache->Store(ctx.cacheKey, output);
         }
         else
         {
-            std::cout << "Running on CPU." << std::endl;
-            device_type = torch::kCPU;
+            ctx.cache->Store(ctx.cacheKey, output);
         }
+        CacheStats stats = ctx.cache->Stats();
+        std::cout << "Cache hits " << stats.hits << ", misses " << stats.misses << ", verified " << stats.verified
+                  << ", mismatches " << stats.mismatches << std::endl;
+    }
 
-        torch::Device device(device_type);
+    std::cout << "Inference completed." << std::endl;
+    return 0;
+}
 
-        module.to(device);
+int main(int argc, const char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <directory> <path-to-exported-script-module> [options]\n"
+                  << "Options:\n"
+                  << "  --multi          treat the second argument as a model list file and run all models\n"
+                  << "  --cores <N>      CPU core budget shared by all models (default: hardware concurrency)\n"
+                  << "  --slice2d        run a 2D model slice by slice on [N, C, H, W] batches\n"
+                  << "  --axis <0|1|2>   slicing axis for --slice2d, 2 = axial (default: 2)\n"
+                  << "  --context <K>    stack K neighbour slices on each side as channels (2.5D, default: 0)\n"
+                  << "  --batch <N>      slices per forward call for --slice2d (default: 16)\n"
+                  << "  --cascade <localizer.pt>  locate ROIs at low resolution first, then run the model only on them\n"
+                  << "  --coarse-spacing <mm>     isotropic spacing of the localizer input (default: 4.0)\n"
+                  << "  --roi-threshold <p>       foreground probability threshold of the localizer (default: 0.5)\n"
+                  << "  --roi-margin-mm <mm>      margin added around each ROI (default: 10.0)\n"
+                  << "  --cache-dir <dir>         reuse results keyed by series UID, slice UIDs and pixel data lengths, model hash and preprocessing\n"
+                  << "  --cache-max-mb <N>        size bound of the result cache, LRU eviction (default: 4096)\n"
+                  << "  --cache-verify-rate <p>   fraction of cache hits recomputed and compared (default: 0)\n"
+                  << "  --mem-budget-mb <N>       host-wide memory budget shared by all inference processes\n"
+                  << "  --mem-ledger <path>       reservation file shared by processes (default: /dev/shm/itk_torch_admission)\n"
+                  << "  --mem-degrade-s <N>       wait N seconds for the full reservation before degrading to patch execution (default: 60)\n"
+                  << "  --mem-wait-s <N>          give up if even patch execution cannot reserve memory within N seconds (default: 600)\n"
+                  << "  --patch-dir <dir>         disk-backed directory for the streaming patch output (default: system temp dir;\n"
+                  << "                            on tmpfs the output is counted against the budget)\n"
+                  << "  --mmap-weights <dir>      export weights once to <dir> and map them read-only, shared by all processes\n"
+                  << "  --read-ahead     prefetch slice files with many reads in flight (io_uring or thread pool)\n"
+                  << "  --io-inflight-mb <N>  upper bound of prefetched bytes not yet decoded (default: 256)\n"
+                  << "  --io-depth <N>   number of reads in flight (default: 32)\n"
+                  << "  --io-latency-ms <N>   add artificial latency to every read, for testing\n";
+        return -1;
+    }
 
-        // 将输入张量移动到与模型相同的设备上
-        tensorImage = tensorImage.to(device);
+    std::string dirName = argv[1];
+    std::string modelPath = argv[2];
 
-        // 准备输入数据
-        std::vector<torch::jit::IValue> inputs;
-        tensorImage = tensorImage.unsqueeze(0).unsqueeze(0); // 形状变为 [1, 1, depth, height, width]
-        inputs.push_back(tensorImage);
+    try
+    {
+        StudyContext ctx;
+        ctx.argc = argc;
+        ctx.argv = argv;
+        ctx.modelPath = modelPath;
+
+        // 预读参数
+        ctx.readAhead.enabled = HasFlag(argc, argv, "--read-ahead");
+        ctx.readAhead.max_inflight_bytes = std::stoull(GetOption(argc, argv, "--io-inflight-mb", "256")) << 20;
+        ctx.readAhead.queue_depth = std::stoi(GetOption(argc, argv, "--io-depth", "32"));
+        ctx.readAhead.io_latency_ms = std::stoi(GetOption(argc, argv, "--io-latency-ms", "0"));
+
+        ctx.fileNames = ITKGetDICOMSeriesFileNames(dirName);
+
+        // 根据头信息选择像素类型 (CT: int16, MR: uint16, PET: float32 ...), 解码和转换都按该类型实例化
+        DICOMPixelKind pixelKind = DetectPixelKind(ctx.fileNames.front());
+        std::cout << "Pixel type: " << PixelKindName(pixelKind) << std::endl;
+
+        // 结果缓存: 同一序列、同一模型、同一预处理参数的结果直接从磁盘返回
+        std::unique_ptr<ResultCache> cache;
+        std::string cacheDir = GetOption(argc, argv, "--cache-dir", "");
+        bool singleModel = !HasFlag(argc, argv, "--multi") && !HasFlag(argc, argv, "--slice2d") &&
+                           GetOption(argc, argv, "--cascade", "").empty();
+        if (!cacheDir.empty() && singleModel)
+        {
+            cache = std::make_unique<ResultCache>(cacheDir, std::stoull(GetOption(argc, argv, "--cache-max-mb", "4096")) << 20,
+                                                  std::stod(GetOption(argc, argv, "--cache-verify-rate", "0")));
+            ctx.cache = cache.get();
+            // 预处理参数包含像素类型: 不同像素类型的解码结果 (是否截断) 不同
+            ctx.cacheKey = cache->MakeKey(ctx.fileNames, modelPath, std::string("HU2uint8:-1024:300:-2000:") + PixelKindName(pixelKind));
+            ctx.cachedOutput = cache->Lookup(ctx.cacheKey);
+            if (ctx.cachedOutput && !cache->ShouldVerify())
+            {
+                CacheStats stats = cache->Stats();
+                std::cout << "Cache hit: " << ctx.cacheKey << "  (hits " << stats.hits << ", misses " << stats.misses << ")" << std::endl;
+                std::cout << "Inference completed." << std::endl;
+                return 0;
+            }
+        }
 
-        // 执行模型推理
-        torch::NoGradGuard no_grad;
-        torch::jit::getProfilingMode() = false;
-        auto output = module.forward(inputs);
+        // 内存预算: 解码前根据头信息估算峰值内存, 预算内才开始执行, 否则降级为分块执行
+        std::unique_ptr<MemoryAdmission> admission;
+        AdmissionOptions admissionOptions;
+        admissionOptions.budget_bytes = std::stoull(GetOption(argc, argv, "--mem-budget-mb", "0")) << 20;
+        admissionOptions.ledger_path = GetOption(argc, argv, "--mem-ledger", admissionOptions.ledger_path);
+        admissionOptions.wait_timeout = std::chrono::seconds(std::stoll(GetOption(argc, argv, "--mem-degrade-s", "60")));
+        admissionOptions.patch_wait_timeout = std::chrono::seconds(std::stoll(GetOption(argc, argv, "--mem-wait-s", "600")));
+        admissionOptions.patch_output_dir = GetOption(argc, argv, "--patch-dir", "");
+        if (ctx.readAhead.enabled)
+            admissionOptions.read_ahead_bytes = ctx.readAhead.max_inflight_bytes;
+        if (admissionOptions.budget_bytes > 0 && !singleModel)
+        {
+            // 多模型 / 2D / 级联模式的峰值内存无法由单一模型估算, 不静默忽略预算
+            throw std::runtime_error("--mem-budget-mb is only supported for single-model inference "
+                                     "(not with --multi, --slice2d or --cascade).");
+        }
+        if (admissionOptions.budget_bytes > 0)
+        {
+            MemoryEstimate est = EstimateStudyMemory(ctx.fileNames, modelPath, PixelKindBytes(pixelKind), admissionOptions);
+            std::cout << "Estimated peak memory: " << (est.Total() >> 20) << " MB (decode " << (est.decode_bytes >> 20)
+                      << ", preprocess " << (est.preprocess_bytes >> 20) << ", model " << (est.model_bytes >> 20)
+                      << ", activations " << (est.activation_bytes >> 20) << ", output " << (est.output_bytes >> 20)
+                      << ", read-ahead " << (est.io_bytes >> 20) << ")"
+                      << std::endl;
+
+            admission = std::make_unique<MemoryAdmission>(admissionOptions);
+            bool admitted = est.Total() <= admissionOptions.budget_bytes &&
+                            admission->Acquire(est.Total(), admissionOptions.wait_timeout);
+            if (!admitted)
+            {
+                ctx.patchPlan = PlanPatchExecution(est, admissionOptions);
+                if (ctx.patchPlan.slab == 0)
+                {
+                    throw std::runtime_error("Study does not fit the memory budget even with streaming patch execution "
+                                             "(model plus the minimum slab exceeds --mem-budget-mb; the output also counts "
+                                             "when the patch directory is on tmpfs, see --patch-dir).");
+                }
+                if (ctx.patchPlan.streaming && !DetectSliceLayout(ctx.fileNames.front()).ParallelDecodable())
+                {
+                    throw std::runtime_error("Streaming patch execution requires single-frame MONOCHROME2 slices.");
+                }
+                std::cout << "Degrading to " << (ctx.patchPlan.streaming ? "streaming " : "") << "patch execution: slab "
+                          << ctx.patchPlan.slab << ", overlap " << ctx.patchPlan.overlap << ", estimated "
+                          << (ctx.patchPlan.bytes >> 20) << " MB"
+                          << (ctx.patchPlan.streaming ? ", output in " + ctx.patchPlan.output_dir : std::string()) << std::endl;
+
+                // 分块执行同样需要预留, 累计等待超过 patch_wait_timeout 后报错
+                auto deadline = std::chrono::steady_clock::now() + admissionOptions.patch_wait_timeout;
+                for (;;)
+                {
+                    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                    if (remaining.count() <= 0)
+                    {
+                        throw std::runtime_error("Timed out waiting for " + std::to_string(ctx.patchPlan.bytes >> 20) +
+                                                 " MB of the memory budget for patch execution.");
+                    }
+                    if (admission->Acquire(ctx.patchPlan.bytes, std::min(admissionOptions.wait_timeout, remaining)))
+                        break;
+                    std::cout << "Waiting for memory budget: need " << (ctx.patchPlan.bytes >> 20) << " MB, "
+                              << (admission->Reserved() >> 20) << " of " << (admissionOptions.budget_bytes >> 20)
+                              << " MB reserved by other processes" << std::endl;
+                }
+            }
+        }
 
-        std::cout << "Inference completed." << std::endl;
+        return DispatchPixelKind(pixelKind, [&](auto tag)
+                                 { return RunStudy<typename decltype(tag)::type>(ctx); });
     }
     catch (const std::exception &e)
     {
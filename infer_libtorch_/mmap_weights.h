@@ -0,0 +1,372 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 权重文件格式:
+//   WeightsHeader | 索引 (每个张量: 名称、dtype、形状、偏移、字节数) | 对齐到页的数据区
+// 每个张量的数据按 64 字节对齐, 可以直接作为 CPU 张量的存储使用
+// 模型结构 (TorchScript 代码, 参数替换为空张量) 另存为 skeleton, 加载时只反序列化代码
+struct WeightsHeader
+{
+    char magic[8];
+    uint64_t source_size;  // 源模型文件大小, 用于判断是否需要重新导出
+    int64_t source_mtime;  // 源模型文件修改时间
+    uint64_t count;        // 张量个数
+    uint64_t data_offset;  // 数据区起始偏移 (页对齐)
+    uint64_t total_bytes;  // 文件总大小
+};
+
+constexpr char kWeightsMagic[8] = {'I', 'T', 'K', 'T', 'W', '0', '0', '1'};
+constexpr uint64_t kWeightsAlignment = 64;
+constexpr uint64_t kWeightsPageSize = 4096;
+
+// 导出 / 映射时使用的两个文件
+struct MappedWeightsPaths
+{
+    std::filesystem::path skeleton;
+    std::filesystem::path weights;
+};
+
+inline MappedWeightsPaths GetMappedWeightsPaths(const std::string &modelPath, const std::string &weightsDir)
+{
+    std::string name = std::filesystem::path(modelPath).filename().string();
+    std::filesystem::path dir(weightsDir);
+    return {dir / (name + ".skeleton.pt"), dir / (name + ".weights")};
+}
+
+// 只读映射的文件, 由所有映射出的张量共同持有, 最后一个张量释放时解除映射
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open weights file: " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(WeightsHeader)))
+        {
+            ::close(fd);
+            throw std::runtime_error("Invalid weights file: " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        // MAP_SHARED + PROT_READ: 各进程共享同一份页缓存, 不产生私有拷贝
+        data_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data_ == MAP_FAILED)
+        {
+            data_ = nullptr;
+            throw std::runtime_error("Cannot map weights file: " + path);
+        }
+    }
+
+    ~MappedFile()
+    {
+        if (data_)
+            ::munmap(data_, size_);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return static_cast<const char *>(data_); }
+    size_t size() const { return size_; }
+
+private:
+    void *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+namespace detail
+{
+    // 按点分隔的名称找到张量所属的子模块, 返回 (子模块, 属性名)
+    inline std::pair<torch::jit::script::Module, std::string> ResolveAttribute(torch::jit::script::Module module, const std::string &name)
+    {
+        size_t begin = 0;
+        size_t dot;
+        while ((dot = name.find('.', begin)) != std::string::npos)
+        {
+            module = module.attr(name.substr(begin, dot - begin)).toModule();
+            begin = dot + 1;
+        }
+        return {module, name.substr(begin)};
+    }
+
+    // 模型中所有参数和 buffer (名称为相对根模块的点分隔路径)
+    inline std::vector<std::pair<std::string, torch::Tensor>> CollectTensors(const torch::jit::script::Module &module)
+    {
+        std::vector<std::pair<std::string, torch::Tensor>> tensors;
+        for (const auto &p : module.named_parameters(true))
+            tensors.emplace_back(p.name, p.value);
+        for (const auto &b : module.named_buffers(true))
+            tensors.emplace_back(b.name, b.value);
+        return tensors;
+    }
+
+    inline bool SourceMatches(const WeightsHeader &header, const std::string &modelPath)
+    {
+        return std::memcmp(header.magic, kWeightsMagic, sizeof(kWeightsMagic)) == 0 &&
+               header.source_size == std::filesystem::file_size(modelPath) &&
+               header.source_mtime == std::filesystem::last_write_time(modelPath).time_since_epoch().count();
+    }
+
+    inline bool WeightsUpToDate(const MappedWeightsPaths &paths, const std::string &modelPath)
+    {
+        if (!std::filesystem::exists(paths.skeleton))
+            return false;
+        std::ifstream in(paths.weights, std::ios::binary);
+        WeightsHeader header;
+        return in.read(reinterpret_cast<char *>(&header), sizeof(header)) && SourceMatches(header, modelPath);
+    }
+
+    // 导出与加载共用的锁文件: 导出持有排它锁, 加载在映射权重和读取 skeleton 期间持有共享锁
+    inline int LockWeights(const MappedWeightsPaths &paths, int operation)
+    {
+        std::filesystem::path lockPath = paths.weights;
+        lockPath += ".lock";
+        int lockFd = ::open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockFd < 0)
+        {
+            throw std::runtime_error("Cannot open lock file: " + lockPath.string());
+        }
+        ::flock(lockFd, operation);
+        return lockFd;
+    }
+
+    inline void UnlockWeights(int lockFd)
+    {
+        ::flock(lockFd, LOCK_UN);
+        ::close(lockFd);
+    }
+
+    inline uint64_t AlignUp(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    template <typename T>
+    void WritePod(std::ofstream &out, const T &value)
+    {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    T ReadPod(const char *&p, const char *end)
+    {
+        if (p + sizeof(T) > end)
+        {
+            throw std::runtime_error("Truncated weights index.");
+        }
+        T value;
+        std::memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return value;
+    }
+}
+
+// 将 TorchScript 模型导出为 skeleton + 对齐的权重文件; 已是最新时直接返回
+// 多个进程同时启动时用文件锁保证只导出一次, 写临时文件后 rename, 其它进程不会看到半个文件
+inline MappedWeightsPaths ExportMappedWeights(const std::string &modelPath, const std::string &weightsDir)
+{
+    MappedWeightsPaths paths = GetMappedWeightsPaths(modelPath, weightsDir);
+    if (detail::WeightsUpToDate(paths, modelPath))
+        return paths;
+
+    std::filesystem::create_directories(weightsDir);
+    int lockFd = detail::LockWeights(paths, LOCK_EX);
+
+    try
+    {
+        if (!detail::WeightsUpToDate(paths, modelPath))
+        {
+            std::cout << "Exporting mapped weights: " << paths.weights << std::endl;
+            torch::jit::script::Module module = torch::jit::load(modelPath, torch::Device(torch::kCPU));
+            std::vector<std::pair<std::string, torch::Tensor>> tensors = detail::CollectTensors(module);
+            if (tensors.empty())
+            {
+                // torch.jit.freeze 后权重是计算图中的常量, 不是参数 / buffer, 无法单独映射
+                throw std::runtime_error("No parameters or buffers to map in " + modelPath +
+                                         " (frozen module?); load it without --mmap-weights.");
+            }
+
+            // 索引大小与各张量的偏移
+            uint64_t indexBytes = 0;
+            for (const auto &[name, t] : tensors)
+                indexBytes += sizeof(uint32_t) + name.size() + sizeof(int32_t) + sizeof(uint32_t) +
+                              t.dim() * sizeof(int64_t) + 2 * sizeof(uint64_t);
+
+            WeightsHeader header;
+            std::memcpy(header.magic, kWeightsMagic, sizeof(kWeightsMagic));
+            header.source_size = std::filesystem::file_size(modelPath);
+            header.source_mtime = std::filesystem::last_write_time(modelPath).time_since_epoch().count();
+            header.count = tensors.size();
+            header.data_offset = detail::AlignUp(sizeof(WeightsHeader) + indexBytes, kWeightsPageSize);
+
+            std::vector<uint64_t> offsets(tensors.size());
+            uint64_t offset = header.data_offset;
+            for (size_t i = 0; i < tensors.size(); ++i)
+            {
+                offsets[i] = offset;
+                offset = detail::AlignUp(offset + tensors[i].second.nbytes(), kWeightsAlignment);
+            }
+            header.total_bytes = offset;
+
+            std::filesystem::path tmpWeights = paths.weights;
+            tmpWeights += ".tmp" + std::to_string(::getpid());
+            {
+                std::ofstream out(tmpWeights, std::ios::binary | std::ios::trunc);
+                detail::WritePod(out, header);
+                for (size_t i = 0; i < tensors.size(); ++i)
+                {
+                    const auto &[name, t] = tensors[i];
+                    detail::WritePod(out, static_cast<uint32_t>(name.size()));
+                    out.write(name.data(), name.size());
+                    detail::WritePod(out, static_cast<int32_t>(t.scalar_type()));
+                    detail::WritePod(out, static_cast<uint32_t>(t.dim()));
+                    for (int64_t s : t.sizes())
+                        detail::WritePod(out, s);
+                    detail::WritePod(out, offsets[i]);
+                    detail::WritePod(out, static_cast<uint64_t>(t.nbytes()));
+                }
+                for (size_t i = 0; i < tensors.size(); ++i)
+                {
+                    torch::Tensor t = tensors[i].second.contiguous();
+                    out.seekp(static_cast<std::streamoff>(offsets[i]));
+                    out.write(static_cast<const char *>(t.data_ptr()), t.nbytes());
+                }
+                // 补齐到 total_bytes, 保证最后一个张量之后的对齐区也在文件内
+                out.seekp(static_cast<std::streamoff>(header.total_bytes - 1));
+                out.put('\0');
+                if (!out)
+                {
+                    throw std::runtime_error("Failed to write weights file: " + tmpWeights.string());
+                }
+            }
+
+            // skeleton: 参数替换为同 dtype 的空张量, 只保留代码和模块结构
+            for (const auto &[name, t] : tensors)
+            {
+                auto [owner, attr] = detail::ResolveAttribute(module, name);
+                owner.setattr(attr, torch::empty({0}, t.options()));
+            }
+            std::filesystem::path tmpSkeleton = paths.skeleton;
+            tmpSkeleton += ".tmp" + std::to_string(::getpid());
+            module.save(tmpSkeleton.string());
+
+            // 先替换 skeleton 再替换权重文件: 权重文件头有效时, 对应的 skeleton 一定已经就位
+            std::filesystem::rename(tmpSkeleton, paths.skeleton);
+            std::filesystem::rename(tmpWeights, paths.weights);
+        }
+    }
+    catch (...)
+    {
+        detail::UnlockWeights(lockFd);
+        throw;
+    }
+
+    detail::UnlockWeights(lockFd);
+    return paths;
+}
+
+// 加载 skeleton 并把每个参数 / buffer 绑定到映射文件中的只读区域
+// 权重不再被读取和反序列化, 页面在首次访问时从页缓存映射, 同一主机上的所有进程共享
+// 映射区域只读: 适用于 CPU 上的推理, 对权重的原地修改会触发段错误
+inline torch::jit::script::Module LoadMappedModule(const std::string &modelPath, const std::string &weightsDir)
+{
+    // 映射权重与读取 skeleton 在共享锁内完成, 不会与另一进程的重新导出交错;
+    // 映射后的文件头与源模型不符 (导出返回后模型又被替换) 时重新导出
+    MappedWeightsPaths paths;
+    std::shared_ptr<MappedFile> mapping;
+    torch::jit::script::Module module;
+    WeightsHeader header;
+    for (int attempt = 0;; ++attempt)
+    {
+        paths = ExportMappedWeights(modelPath, weightsDir);
+        int lockFd = detail::LockWeights(paths, LOCK_SH);
+        try
+        {
+            mapping = std::make_shared<MappedFile>(paths.weights.string());
+            std::memcpy(&header, mapping->data(), sizeof(header));
+            if (std::memcmp(header.magic, kWeightsMagic, sizeof(kWeightsMagic)) != 0 || header.total_bytes > mapping->size())
+            {
+                throw std::runtime_error("Invalid weights file: " + paths.weights.string());
+            }
+            bool matches = detail::SourceMatches(header, modelPath);
+            if (matches)
+                module = torch::jit::load(paths.skeleton.string(), torch::Device(torch::kCPU));
+            detail::UnlockWeights(lockFd);
+            if (matches)
+                break;
+        }
+        catch (...)
+        {
+            detail::UnlockWeights(lockFd);
+            throw;
+        }
+        if (attempt >= 2)
+        {
+            throw std::runtime_error("Model keeps changing while mapping its weights: " + modelPath);
+        }
+    }
+
+    // skeleton 与源模型大小相近说明权重大多不是参数 / buffer (例如 torch.jit.freeze 折叠出的常量), 映射几乎不共享内存
+    uint64_t skeletonBytes = std::filesystem::file_size(paths.skeleton);
+    uint64_t sourceBytes = std::filesystem::file_size(modelPath);
+    if (skeletonBytes * 2 > sourceBytes)
+    {
+        std::cerr << "Warning: skeleton " << paths.skeleton << " is " << (skeletonBytes >> 10) << " KB of the "
+                  << (sourceBytes >> 10) << " KB model; most weights are not mapped and will not be shared." << std::endl;
+    }
+
+    const char *begin = mapping->data();
+    const char *end = begin + mapping->size();
+
+    const char *p = begin + sizeof(WeightsHeader);
+    for (uint64_t i = 0; i < header.count; ++i)
+    {
+        uint32_t nameSize = detail::ReadPod<uint32_t>(p, end);
+        if (p + nameSize > end)
+        {
+            throw std::runtime_error("Truncated weights index.");
+        }
+        std::string name(p, nameSize);
+        p += nameSize;
+        auto dtype = static_cast<torch::ScalarType>(detail::ReadPod<int32_t>(p, end));
+        uint32_t dim = detail::ReadPod<uint32_t>(p, end);
+        std::vector<int64_t> sizes(dim);
+        for (uint32_t d = 0; d < dim; ++d)
+            sizes[d] = detail::ReadPod<int64_t>(p, end);
+        uint64_t offset = detail::ReadPod<uint64_t>(p, end);
+        uint64_t nbytes = detail::ReadPod<uint64_t>(p, end);
+        if (offset + nbytes > header.total_bytes)
+        {
+            throw std::runtime_error("Weights entry out of range: " + name);
+        }
+
+        // 张量的 deleter 持有映射, 模块释放前映射一直有效
+        torch::Tensor t = torch::from_blob(const_cast<char *>(begin + offset), sizes, [mapping](void *) {},
+                                           torch::TensorOptions().dtype(dtype));
+        auto [owner, attr] = detail::ResolveAttribute(module, name);
+        owner.setattr(attr, t);
+    }
+
+    return module;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+
+// 模型输出的预测张量: 多输出模型 (如分割 + 置信度、关键点 + 置信度) 取第一个输出
+inline torch::Tensor FirstOutputTensor(const torch::jit::IValue &output)
+{
+    return output.isTuple() ? output.toTuple()->elements()[0].toTensor() : output.toTensor();
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+#include "parallel_tasks.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// 单个模型的输入规格: 模型路径、HU 窗口、目标 spacing 和输入 dtype
+// float32 / float16: 加窗归一化到 [0, 1]; uint8: [0, 255]; int16: 截断到窗口内的 HU 值
+struct ModelSpec
+{
+    std::string path;
+    float HU_min = -1024.0f;
+    float HU_max = 300.0f;
+    float HU_nan = -2000.0f;
+    std::array<double, 3> spacing = {0.0, 0.0, 0.0}; // 全为 0 表示保持原始 spacing
+    torch::ScalarType dtype = torch::kFloat32;
+};
+
+// 字符串转换为 torch dtype
+inline torch::ScalarType ParseDtype(const std::string &name)
+{
+    if (name == "float32" || name == "float")
+        return torch::kFloat32;
+    if (name == "float16" || name == "half")
+        return torch::kFloat16;
+    if (name == "uint8")
+        return torch::kUInt8;
+    if (name == "int16")
+        return torch::kInt16;
+    throw std::runtime_error("Unsupported dtype: " + name);
+}
+
+// 读取模型列表文件, 每行格式:
+// <model.pt> <HU_min> <HU_max> <dtype> [<spacing_x> <spacing_y> <spacing_z>]
+// 以 # 开头的行为注释
+inline std::vector<ModelSpec> LoadModelSpecs(const std::string &listPath)
+{
+    std::ifstream in(listPath);
+    if (!in)
+    {
+        throw std::runtime_error("Cannot open model list: " + listPath);
+    }
+
+    std::vector<ModelSpec> specs;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::istringstream ss(line);
+        ModelSpec spec;
+        std::string dtype;
+        if (!(ss >> spec.path >> spec.HU_min >> spec.HU_max >> dtype))
+        {
+            throw std::runtime_error("Malformed model list line: " + line);
+        }
+        spec.dtype = ParseDtype(dtype);
+        ss >> spec.spacing[0] >> spec.spacing[1] >> spec.spacing[2];
+        specs.push_back(spec);
+    }
+
+    if (specs.empty())
+    {
+        throw std::runtime_error("No models listed in: " + listPath);
+    }
+    return specs;
+}
+
+// 多个模型共享的预处理中间结果
+// 每个子步骤 (重采样 / 加窗) 以其参数为 key 只计算一次, 并发请求同一个 key 时等待同一个 future
+class SharedPreprocessCache
+{
+public:
+    // huVolume: [1, 1, X, Y, Z] float32 HU 值
+    SharedPreprocessCache(torch::Tensor huVolume, const std::array<double, 3> &spacing)
+        : huVolume_(std::move(huVolume)), spacing_(spacing) {}
+
+    // 获取某个模型的输入张量
+    torch::Tensor Input(const ModelSpec &spec)
+    {
+        std::ostringstream key;
+        key << SpacingKey(spec.spacing) << "|" << spec.HU_min << "," << spec.HU_max << "," << spec.HU_nan
+            << "|" << static_cast<int>(spec.dtype);
+        return GetOrCompute(key.str(), [this, &spec]()
+                            {
+                                // int16 模型直接接收截断到窗口内的 HU 整数值, 不经过 [0, 1] 归一化
+                                if (spec.dtype == torch::kInt16)
+                                {
+                                    torch::Tensor x = torch::nan_to_num(Resampled(spec.spacing), spec.HU_nan);
+                                    return x.clamp(spec.HU_min, spec.HU_max).round().to(torch::kInt16);
+                                }
+                                torch::Tensor windowed = Windowed(spec);
+                                return spec.dtype == torch::kUInt8
+                                           ? windowed.mul(255.0).round().to(torch::kUInt8)
+                                           : windowed.to(spec.dtype); });
+    }
+
+    // 实际计算的子步骤数量 (用于验证共享是否生效)
+    int ComputedSteps() const { return computed_.load(); }
+
+private:
+    using Future = std::shared_future<torch::Tensor>;
+
+    std::string SpacingKey(const std::array<double, 3> &target) const
+    {
+        if (target[0] <= 0.0 || target[1] <= 0.0 || target[2] <= 0.0)
+            return "native";
+        std::ostringstream key;
+        key << target[0] << "x" << target[1] << "x" << target[2];
+        return key.str();
+    }
+
+    // 重采样到目标 spacing (三线性插值)
+    torch::Tensor Resampled(const std::array<double, 3> &target)
+    {
+        std::string key = SpacingKey(target);
+        if (key == "native")
+            return huVolume_;
+
+        return GetOrCompute("resample|" + key, [this, &target]()
+                            {
+                                std::vector<int64_t> outSize(3);
+                                for (int d = 0; d < 3; ++d)
+                                {
+                                    double extent = huVolume_.size(d + 2) * spacing_[d];
+                                    outSize[d] = std::max<int64_t>(1, static_cast<int64_t>(std::lround(extent / target[d])));
+                                }
+                                namespace F = torch::nn::functional;
+                                return F::interpolate(huVolume_, F::InterpolateFuncOptions()
+                                                                     .size(outSize)
+                                                                     .mode(torch::kTrilinear)
+                                                                     .align_corners(false)); });
+    }
+
+    // HU 加窗并归一化到 [0, 1], 与 HU2uint8 的处理一致
+    torch::Tensor Windowed(const ModelSpec &spec)
+    {
+        std::ostringstream key;
+        key << "window|" << SpacingKey(spec.spacing) << "|" << spec.HU_min << "," << spec.HU_max << "," << spec.HU_nan;
+        return GetOrCompute(key.str(), [this, &spec]()
+                            {
+                                torch::Tensor x = Resampled(spec.spacing);
+                                x = torch::nan_to_num(x, spec.HU_nan);
+                                return ((x - spec.HU_min) / (spec.HU_max - spec.HU_min)).clamp(0.0, 1.0); });
+    }
+
+    template <typename Fn>
+    torch::Tensor GetOrCompute(const std::string &key, Fn &&fn)
+    {
+        std::promise<torch::Tensor> promise;
+        Future future;
+        bool owner = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = steps_.find(key);
+            if (it != steps_.end())
+            {
+                future = it->second;
+            }
+            else
+            {
+                future = promise.get_future().share();
+                steps_.emplace(key, future);
+                owner = true;
+            }
+        }
+
+        // 只有插入 key 的线程负责计算, 其余线程等待结果
+        if (owner)
+        {
+            try
+            {
+                torch::NoGradGuard no_grad;
+                promise.set_value(fn());
+                ++computed_;
+            }
+            catch (...)
+            {
+                promise.set_exception(std::current_exception());
+            }
+        }
+        return future.get();
+    }
+
+    torch::Tensor huVolume_;
+    std::array<double, 3> spacing_;
+    std::mutex mutex_;
+    std::map<std::string, Future> steps_;
+    std::atomic<int> computed_{0};
+};
+
+// 单个模型的推理结果
+struct ModelResult
+{
+    std::string path;
+    torch::jit::IValue output;
+    double preprocess_ms = 0.0;
+    double forward_ms = 0.0;
+};
+
+// 在固定的 CPU 核数预算内并发执行多个模型
+// 同时运行的模型数不超过 coreBudget, 每个模型的 intra-op 线程数为 coreBudget / 并发数
+inline std::vector<ModelResult> RunMultiModel(const torch::Tensor &huVolume, const std::array<double, 3> &spacing,
+                                              const std::vector<ModelSpec> &specs, int coreBudget, torch::Device device)
+{
+    coreBudget = std::max(1, coreBudget);
+    int concurrency = std::min<int>(coreBudget, static_cast<int>(specs.size()));
+    at::set_num_threads(std::max(1, coreBudget / concurrency));
+    std::cout << "Running " << specs.size() << " models, " << concurrency << " concurrently, "
+              << at::get_num_threads() << " threads each." << std::endl;
+
+    // 加载所有模型
+    std::vector<torch::jit::script::Module> modules(specs.size());
+    for (size_t i = 0; i < specs.size(); ++i)
+    {
+        try
+        {
+            modules[i] = torch::jit::load(specs[i].path);
+        }
+        catch (const c10::Error &e)
+        {
+            throw std::runtime_error("Error loading the module: " + specs[i].path);
+        }
+        modules[i].eval();
+        modules[i].to(device);
+    }
+
+    SharedPreprocessCache cache(huVolume, spacing);
+    std::vector<ModelResult> results(specs.size());
+
+    torch::jit::getProfilingMode() = false;
+    ParallelForEachIndex(specs.size(), static_cast<unsigned int>(concurrency), [&](size_t i, unsigned int)
+                         {
+                             torch::NoGradGuard no_grad;
+                             auto t0 = std::chrono::steady_clock::now();
+                             torch::Tensor input = cache.Input(specs[i]).to(device);
+                             auto t1 = std::chrono::steady_clock::now();
+
+                             std::vector<torch::jit::IValue> inputs{input};
+                             results[i].output = modules[i].forward(inputs);
+                             auto t2 = std::chrono::steady_clock::now();
+
+                             results[i].path = specs[i].path;
+                             results[i].preprocess_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+                             results[i].forward_ms = std::chrono::duration<double, std::milli>(t2 - t1).count(); });
+
+    std::cout << "Shared preprocessing steps computed: " << cache.ComputedSteps() << std::endl;
+    for (const auto &r : results)
+    {
+        std::cout << r.path << "  preprocess " << r.preprocess_ms << " ms  forward " << r.forward_ms << " ms" << std::endl;
+    }
+    return results;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+// 用 numThreads 个线程按索引顺序领取 [0, count) 中的任务, task(i, t) 中 t 为线程编号 (可用于线程局部的缓冲区)
+// numThreads 为 0 时使用硬件线程数; 任一任务抛出异常后不再领取新任务, 所有线程结束后重新抛出第一个异常
+template <typename TTask>
+void ParallelForEachIndex(size_t count, unsigned int numThreads, TTask &&task)
+{
+    if (count == 0)
+        return;
+    if (numThreads == 0)
+    {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    numThreads = static_cast<unsigned int>(std::min<size_t>(numThreads, count));
+
+    std::atomic<size_t> next{0};
+    std::vector<std::exception_ptr> errors(numThreads);
+    auto worker = [&](unsigned int t)
+    {
+        try
+        {
+            for (size_t i = next++; i < count; i = next++)
+            {
+                task(i, t);
+            }
+        }
+        catch (...)
+        {
+            errors[t] = std::current_exception();
+            next = count;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < numThreads; ++t)
+    {
+        workers.emplace_back(worker, t);
+    }
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+    for (auto &e : errors)
+    {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
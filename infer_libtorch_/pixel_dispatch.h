@@ -0,0 +1,140 @@
+#pragma once
+
+#include "gdcmReader.h"
+#include "gdcmStringFilter.h"
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+// 根据 DICOM 头信息选择的像素类型, 每种对应一个编译好的加载 / 转换模板实例
+enum class DICOMPixelKind
+{
+    UInt8,   // 8 位二次采集图像等
+    Int16,   // CT (rescale 后为有符号 HU)
+    UInt16,  // MR 等无符号 16 位
+    Float32, // PET (非整数 slope) 及 32 位数据
+};
+
+template <typename T>
+struct PixelTag
+{
+    using type = T;
+};
+
+inline const char *PixelKindName(DICOMPixelKind kind)
+{
+    switch (kind)
+    {
+    case DICOMPixelKind::UInt8:
+        return "uint8";
+    case DICOMPixelKind::Int16:
+        return "int16";
+    case DICOMPixelKind::UInt16:
+        return "uint16";
+    case DICOMPixelKind::Float32:
+        return "float32";
+    }
+    return "unknown";
+}
+
+inline size_t PixelKindBytes(DICOMPixelKind kind)
+{
+    switch (kind)
+    {
+    case DICOMPixelKind::UInt8:
+        return 1;
+    case DICOMPixelKind::Int16:
+    case DICOMPixelKind::UInt16:
+        return 2;
+    case DICOMPixelKind::Float32:
+        return 4;
+    }
+    return 4;
+}
+
+// 读取第一个切片的头信息, 选择能无损容纳 rescale 后数值的最小像素类型 (CT 固定为 int16)
+inline DICOMPixelKind DetectPixelKind(const std::string &fileName)
+{
+    gdcm::Reader reader;
+    reader.SetFileName(fileName.c_str());
+    if (!reader.ReadUpToTag(gdcm::Tag(0x7fe0, 0x0010)))
+    {
+        throw std::runtime_error("Cannot read DICOM header: " + fileName);
+    }
+    gdcm::StringFilter filter;
+    filter.SetFile(reader.GetFile());
+
+    auto number = [&](uint16_t group, uint16_t element, double defaultValue)
+    {
+        std::string value = filter.ToString(gdcm::Tag(group, element));
+        try
+        {
+            return value.empty() ? defaultValue : std::stod(value);
+        }
+        catch (const std::exception &)
+        {
+            return defaultValue;
+        }
+    };
+
+    std::string modality = filter.ToString(gdcm::Tag(0x0008, 0x0060));
+    const int bitsAllocated = static_cast<int>(number(0x0028, 0x0100, 16));
+    const int bitsStored = static_cast<int>(number(0x0028, 0x0101, bitsAllocated));
+    const bool isSigned = number(0x0028, 0x0103, 0) == 1;
+    const double intercept = number(0x0028, 0x1052, 0.0);
+    const double slope = number(0x0028, 0x1053, 1.0);
+
+    if (modality.find("PT") != std::string::npos || bitsAllocated > 16 ||
+        slope != std::floor(slope) || intercept != std::floor(intercept))
+    {
+        return DICOMPixelKind::Float32;
+    }
+
+    // CT 的 HU 值总在 int16 范围内 (常见的无符号 16 位存储 + intercept -1024 按位宽会算出 [-1024, 64511])
+    if (modality.find("CT") != std::string::npos)
+    {
+        return DICOMPixelKind::Int16;
+    }
+
+    // rescale 后的取值范围; 有 Smallest / Largest Image Pixel Value 时按实际存储值范围计算
+    double storedMin = isSigned ? -std::ldexp(1.0, bitsStored - 1) : 0.0;
+    double storedMax = isSigned ? std::ldexp(1.0, bitsStored - 1) - 1.0 : std::ldexp(1.0, bitsStored) - 1.0;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const double smallest = number(0x0028, 0x0106, nan);
+    const double largest = number(0x0028, 0x0107, nan);
+    if (!std::isnan(smallest) && !std::isnan(largest) && smallest <= largest)
+    {
+        storedMin = std::max(storedMin, smallest);
+        storedMax = std::min(storedMax, largest);
+    }
+    double lo = std::min(storedMin * slope, storedMax * slope) + intercept;
+    double hi = std::max(storedMin * slope, storedMax * slope) + intercept;
+
+    if (lo >= 0.0 && hi <= 255.0)
+        return DICOMPixelKind::UInt8;
+    if (lo >= -32768.0 && hi <= 32767.0)
+        return DICOMPixelKind::Int16;
+    if (lo >= 0.0 && hi <= 65535.0)
+        return DICOMPixelKind::UInt16;
+    return DICOMPixelKind::Float32;
+}
+
+// 运行时分派到对应像素类型的模板实例: fn(PixelTag<T>{})
+template <typename Fn>
+auto DispatchPixelKind(DICOMPixelKind kind, Fn &&fn)
+{
+    switch (kind)
+    {
+    case DICOMPixelKind::UInt8:
+        return fn(PixelTag<uint8_t>{});
+    case DICOMPixelKind::UInt16:
+        return fn(PixelTag<uint16_t>{});
+    case DICOMPixelKind::Float32:
+        return fn(PixelTag<float>{});
+    case DICOMPixelKind::Int16:
+    default:
+        return fn(PixelTag<int16_t>{});
+    }
+}
@@ -0,0 +1,389 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// 预读参数
+struct ReadAheadOptions
+{
+    bool enabled = false;
+    size_t max_inflight_bytes = 256u << 20; // 已读取但尚未被解码器取走的字节上限
+    unsigned int queue_depth = 32;          // 同时在途的读请求数
+    bool use_uring = true;                  // Linux 上优先使用 io_uring, 不可用时退回线程池
+    unsigned int io_latency_ms = 0;         // 测试用: 每次读请求人为增加的延迟 (两种后端都适用)
+};
+
+// 将内存缓冲区包装成 std::istream 可用的 streambuf, 避免再次拷贝
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+    MemoryStreamBuf(char *data, size_t size) { setg(data, data, data + size); }
+
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override
+    {
+        char *target = dir == std::ios_base::beg ? eback() + off : dir == std::ios_base::cur ? gptr() + off
+                                                                                              : egptr() + off;
+        if (target < eback() || target > egptr())
+            return pos_type(off_type(-1));
+        setg(eback(), target, egptr());
+        return pos_type(target - eback());
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode mode) override
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, mode);
+    }
+};
+
+// 对排好序的切片文件列表发起多个并发读请求, 按索引交给解码器
+// 在途字节数 (正在读取 + 已读取未取走) 不超过 max_inflight_bytes
+class DicomReadAhead
+{
+public:
+    DicomReadAhead(const std::vector<std::string> &fileNames, const ReadAheadOptions &options)
+        : fileNames_(fileNames), options_(options), sizes_(fileNames.size()), buffers_(fileNames.size()),
+          ready_(fileNames.size(), false), errors_(fileNames.size())
+    {
+        for (size_t i = 0; i < fileNames_.size(); ++i)
+        {
+            struct stat st;
+            if (::stat(fileNames_[i].c_str(), &st) != 0)
+            {
+                throw std::runtime_error("Cannot stat DICOM file: " + fileNames_[i]);
+            }
+            sizes_[i] = static_cast<size_t>(st.st_size);
+        }
+
+        options_.queue_depth = std::max(1u, options_.queue_depth);
+#ifdef HAVE_LIBURING
+        if (options_.use_uring && io_uring_queue_init(options_.queue_depth, &ring_, 0) == 0)
+        {
+            usingUring_ = true;
+            threads_.emplace_back(&DicomReadAhead::UringLoop, this);
+            return;
+        }
+#endif
+        for (unsigned int t = 0; t < options_.queue_depth; ++t)
+        {
+            threads_.emplace_back(&DicomReadAhead::ThreadPoolLoop, this);
+        }
+    }
+
+    ~DicomReadAhead()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : threads_)
+        {
+            t.join();
+        }
+#ifdef HAVE_LIBURING
+        if (usingUring_)
+            io_uring_queue_exit(&ring_);
+#endif
+    }
+
+    DicomReadAhead(const DicomReadAhead &) = delete;
+    DicomReadAhead &operator=(const DicomReadAhead &) = delete;
+
+    // 阻塞直到第 i 个文件读取完成, 取走其内容并释放在途配额
+    // 任一文件读取失败后不再发起新的读取, 所有等待中的调用都抛出该错误
+    std::vector<char> Take(size_t i)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]
+                 { return ready_[i] || errors_[i] || firstError_; });
+        if (errors_[i])
+        {
+            std::rethrow_exception(errors_[i]);
+        }
+        if (!ready_[i])
+        {
+            std::rethrow_exception(firstError_);
+        }
+        std::vector<char> data = std::move(buffers_[i]);
+        inflight_ -= sizes_[i];
+        lock.unlock();
+        cv_.notify_all();
+        return data;
+    }
+
+    bool UsingUring() const { return usingUring_; }
+
+private:
+    // 所有文件都已发起读取, 或已有读取失败
+    bool Exhausted() const
+    {
+        return next_ >= fileNames_.size() || firstError_;
+    }
+
+    // 在锁内判断下一个文件能否发起读取; 单个超过上限的文件在无在途数据时也允许读取
+    bool CanIssue() const
+    {
+        return !Exhausted() &&
+               (inflight_ == 0 || inflight_ + sizes_[next_] <= options_.max_inflight_bytes);
+    }
+
+    // 读取失败时没有缓冲区等待取走, 立即释放该文件的在途配额
+    void Complete(size_t i, std::vector<char> data, std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffers_[i] = std::move(data);
+            errors_[i] = error;
+            ready_[i] = !error;
+            if (error)
+            {
+                inflight_ -= sizes_[i];
+                if (!firstError_)
+                    firstError_ = error;
+            }
+        }
+        cv_.notify_all();
+    }
+
+    static std::vector<char> ReadWholeFile(const std::string &fileName, size_t size)
+    {
+        int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open DICOM file: " + fileName);
+        }
+        std::vector<char> data(size);
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = ::pread(fd, data.data() + done, size - done, static_cast<off_t>(done));
+            if (n <= 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Cannot read DICOM file: " + fileName);
+            }
+            done += static_cast<size_t>(n);
+        }
+        ::close(fd);
+        return data;
+    }
+
+    // 线程池后端: queue_depth 个线程各自执行阻塞读
+    void ThreadPoolLoop()
+    {
+        for (;;)
+        {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&]
+                         { return stop_ || Exhausted() || CanIssue(); });
+                if (stop_ || Exhausted())
+                    return;
+                i = next_++;
+                inflight_ += sizes_[i];
+            }
+
+            try
+            {
+                if (options_.io_latency_ms > 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(options_.io_latency_ms));
+                }
+                Complete(i, ReadWholeFile(fileNames_[i], sizes_[i]), nullptr);
+            }
+            catch (...)
+            {
+                Complete(i, {}, std::current_exception());
+            }
+        }
+    }
+
+#ifdef HAVE_LIBURING
+    // 一个读请求的状态; 短读时从 done 处继续提交
+    struct UringRequest
+    {
+        size_t index;
+        int fd;
+        size_t done;
+        std::vector<char> data;
+    };
+
+    void SubmitRead(UringRequest *req)
+    {
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+        io_uring_prep_read(sqe, req->fd, req->data.data() + req->done,
+                           static_cast<unsigned>(req->data.size() - req->done), req->done);
+        io_uring_sqe_set_data(sqe, req);
+    }
+
+    void FinishRequest(UringRequest *req, std::exception_ptr error)
+    {
+        ::close(req->fd);
+        Complete(req->index, error ? std::vector<char>() : std::move(req->data), error);
+        delete req;
+    }
+
+    // io_uring 后端: 单线程提交最多 queue_depth 个读请求并回收完成事件
+    // io_latency_ms > 0 时, 已完成的请求先保留 io_latency_ms 再交给解码器, 期间仍占用一个在途位置 (与线程池一致)
+    void UringLoop()
+    {
+        using Clock = std::chrono::steady_clock;
+        const auto latency = std::chrono::milliseconds(options_.io_latency_ms);
+        std::deque<std::pair<Clock::time_point, UringRequest *>> held; // 完成时间加同一延迟, 按到期先后排列
+        unsigned int pending = 0;                                       // 已提交或已保留的请求
+        for (;;)
+        {
+            // 在配额内尽可能多地提交新请求
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&]
+                         { return stop_ || pending > 0 || Exhausted() || CanIssue(); });
+                if (stop_ || (pending == 0 && Exhausted()))
+                    break;
+
+                while (pending < options_.queue_depth && CanIssue())
+                {
+                    size_t i = next_++;
+                    inflight_ += sizes_[i];
+                    lock.unlock();
+
+                    int fd = ::open(fileNames_[i].c_str(), O_RDONLY | O_CLOEXEC);
+                    if (fd < 0)
+                    {
+                        Complete(i, {}, std::make_exception_ptr(std::runtime_error("Cannot open DICOM file: " + fileNames_[i])));
+                    }
+                    else if (sizes_[i] == 0)
+                    {
+                        ::close(fd);
+                        Complete(i, {}, nullptr);
+                    }
+                    else
+                    {
+                        SubmitRead(new UringRequest{i, fd, 0, std::vector<char>(sizes_[i])});
+                        ++pending;
+                    }
+                    lock.lock();
+                }
+            }
+
+            // 交出已到期的保留请求
+            while (!held.empty() && held.front().first <= Clock::now())
+            {
+                --pending;
+                FinishRequest(held.front().second, nullptr);
+                held.pop_front();
+            }
+
+            if (pending == 0)
+                continue;
+
+            io_uring_submit(&ring_);
+
+            io_uring_cqe *cqe = nullptr;
+            if (!held.empty())
+            {
+                // 最多等到最早的保留请求到期
+                auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(held.front().first - Clock::now());
+                if (pending == held.size())
+                {
+                    std::this_thread::sleep_for(wait);
+                    continue;
+                }
+                __kernel_timespec ts{};
+                ts.tv_sec = std::max<int64_t>(0, wait.count()) / 1000000000;
+                ts.tv_nsec = std::max<int64_t>(0, wait.count()) % 1000000000;
+                if (io_uring_wait_cqe_timeout(&ring_, &cqe, &ts) != 0)
+                    continue;
+            }
+            else if (io_uring_wait_cqe(&ring_, &cqe) != 0)
+                continue;
+
+            // 回收所有已完成的事件
+            do
+            {
+                auto *req = static_cast<UringRequest *>(io_uring_cqe_get_data(cqe));
+                int res = cqe->res;
+                io_uring_cqe_seen(&ring_, cqe);
+
+                if (res <= 0)
+                {
+                    --pending;
+                    FinishRequest(req, std::make_exception_ptr(std::runtime_error("Cannot read DICOM file: " + fileNames_[req->index])));
+                }
+                else if (req->done + res < req->data.size())
+                {
+                    req->done += res;
+                    SubmitRead(req);
+                }
+                else if (latency.count() > 0)
+                {
+                    held.emplace_back(Clock::now() + latency, req);
+                }
+                else
+                {
+                    --pending;
+                    FinishRequest(req, nullptr);
+                }
+            } while (io_uring_peek_cqe(&ring_, &cqe) == 0);
+        }
+
+        // 保留中的请求已读完, 内核不再访问其缓冲区
+        for (auto &h : held)
+        {
+            --pending;
+            FinishRequest(h.second, std::make_exception_ptr(std::runtime_error("Read-ahead cancelled")));
+        }
+
+        // 退出前等待所有已提交的请求完成, 避免内核写入已释放的缓冲区
+        while (pending > 0)
+        {
+            io_uring_submit(&ring_);
+            io_uring_cqe *cqe = nullptr;
+            if (io_uring_wait_cqe(&ring_, &cqe) != 0)
+                break;
+            auto *req = static_cast<UringRequest *>(io_uring_cqe_get_data(cqe));
+            io_uring_cqe_seen(&ring_, cqe);
+            --pending;
+            FinishRequest(req, std::make_exception_ptr(std::runtime_error("Read-ahead cancelled")));
+        }
+    }
+
+    io_uring ring_;
+#endif
+
+    std::vector<std::string> fileNames_;
+    ReadAheadOptions options_;
+    std::vector<size_t> sizes_;
+    std::vector<std::vector<char>> buffers_;
+    std::vector<bool> ready_;
+    std::vector<std::exception_ptr> errors_;
+    std::exception_ptr firstError_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t next_ = 0;
+    size_t inflight_ = 0;
+    bool stop_ = false;
+    bool usingUring_ = false;
+    std::vector<std::thread> threads_;
+};
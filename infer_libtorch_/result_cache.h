@@ -0,0 +1,375 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+#include <torch/csrc/jit/serialization/pickle.h>
+#include "gdcmReader.h"
+#include "gdcmStringFilter.h"
+#include "parallel_tasks.h"
+#include <zlib.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// 64 位 FNV-1a 哈希, 可分段累加
+struct Fnv1a
+{
+    uint64_t value = 1469598103934665603ull;
+
+    void Update(const void *data, size_t size)
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            value ^= p[i];
+            value *= 1099511628211ull;
+        }
+    }
+
+    void Update(const std::string &s) { Update(s.data(), s.size() + 1); }
+
+    std::string Hex() const
+    {
+        std::ostringstream ss;
+        ss << std::hex << std::setw(16) << std::setfill('0') << value;
+        return ss.str();
+    }
+};
+
+// 缓存命中统计, 保存在缓存目录中, 多个进程共享
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t verified = 0;
+    uint64_t mismatches = 0;
+};
+
+// 以 SeriesInstanceUID + 切片标识摘要 + 模型文件哈希 + 预处理参数为 key 的推理结果缓存
+// 结果用 pickle 序列化后 zlib 压缩存放在本地磁盘, 按文件修改时间做 LRU 淘汰
+class ResultCache
+{
+public:
+    ResultCache(const std::string &cacheDir, uint64_t maxBytes, double verifyRate = 0.0)
+        : dir_(cacheDir), maxBytes_(maxBytes), verifyRate_(verifyRate), rng_(std::random_device{}())
+    {
+        std::filesystem::create_directories(dir_ / "results");
+        std::filesystem::create_directories(dir_ / "models");
+    }
+
+    // 计算缓存 key; fileNames 为推理所用序列的有序文件列表 (ITKGetDICOMSeriesFileNames)
+    // 切片标识只来自头信息 (SOPInstanceUID + 像素数据长度), 不读取像素; PACS 重发产生的新文件名 / 修改时间仍能命中
+    std::string MakeKey(const std::vector<std::string> &fileNames, const std::string &modelPath, const std::string &preprocessParams)
+    {
+        if (fileNames.empty())
+        {
+            throw std::runtime_error("Empty DICOM file list.");
+        }
+
+        // 各切片的摘要并行计算, 再按序列顺序合并
+        std::vector<std::string> sliceDigests(fileNames.size());
+        ParallelForEachIndex(fileNames.size(), 0, [&](size_t i, unsigned int)
+                             { sliceDigests[i] = SliceDigest(fileNames[i]); });
+
+        Fnv1a digest;
+        for (const auto &d : sliceDigests)
+            digest.Update(d);
+
+        Fnv1a key;
+        key.Update(ReadSeriesInstanceUID(fileNames.front()));
+        key.Update(digest.Hex());
+        key.Update(ModelHash(modelPath));
+        key.Update(preprocessParams);
+        return key.Hex();
+    }
+
+    // 查找缓存结果; 命中时刷新修改时间 (LRU)
+    std::optional<torch::jit::IValue> Lookup(const std::string &key)
+    {
+        std::filesystem::path path = ResultPath(key);
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            UpdateStats([](CacheStats &s)
+                        { ++s.misses; });
+            return std::nullopt;
+        }
+
+        uint64_t rawSize = 0;
+        if (!in.read(reinterpret_cast<char *>(&rawSize), sizeof(rawSize)))
+            return Corrupt(path);
+        std::vector<char> compressed((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::vector<char> raw(rawSize);
+        uLongf destLen = rawSize;
+        if (uncompress(reinterpret_cast<Bytef *>(raw.data()), &destLen,
+                       reinterpret_cast<const Bytef *>(compressed.data()), compressed.size()) != Z_OK ||
+            destLen != rawSize)
+        {
+            return Corrupt(path);
+        }
+
+        std::error_code ec;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        UpdateStats([](CacheStats &s)
+                    { ++s.hits; });
+        return torch::jit::pickle_load(raw);
+    }
+
+    // 按 verifyRate 抽样, 决定本次命中是否需要重新计算校验
+    bool ShouldVerify()
+    {
+        return verifyRate_ > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(rng_) < verifyRate_;
+    }
+
+    // 记录一次校验结果
+    void RecordVerification(bool match)
+    {
+        UpdateStats([match](CacheStats &s)
+                    {
+                        ++s.verified;
+                        if (!match)
+                            ++s.mismatches; });
+    }
+
+    // 写入结果: 先写临时文件再 rename, 保证并发读取时不会看到半个文件
+    void Store(const std::string &key, const torch::jit::IValue &output)
+    {
+        std::vector<char> raw = torch::jit::pickle_save(output);
+        uLongf compressedSize = compressBound(raw.size());
+        std::vector<char> compressed(compressedSize);
+        if (compress2(reinterpret_cast<Bytef *>(compressed.data()), &compressedSize,
+                      reinterpret_cast<const Bytef *>(raw.data()), raw.size(), Z_BEST_SPEED) != Z_OK)
+        {
+            throw std::runtime_error("Failed to compress inference result.");
+        }
+
+        std::filesystem::path path = ResultPath(key);
+        std::filesystem::path tmp = path;
+        tmp += ".tmp" + std::to_string(::getpid());
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            uint64_t rawSize = raw.size();
+            out.write(reinterpret_cast<const char *>(&rawSize), sizeof(rawSize));
+            out.write(compressed.data(), compressedSize);
+            if (!out)
+            {
+                throw std::runtime_error("Failed to write cache entry: " + tmp.string());
+            }
+        }
+        std::filesystem::rename(tmp, path);
+        Evict();
+    }
+
+    CacheStats Stats()
+    {
+        CacheStats stats;
+        UpdateStats([&stats](CacheStats &s)
+                    { stats = s; });
+        return stats;
+    }
+
+private:
+    std::filesystem::path ResultPath(const std::string &key) const
+    {
+        return dir_ / "results" / (key + ".bin");
+    }
+
+    std::optional<torch::jit::IValue> Corrupt(const std::filesystem::path &path)
+    {
+        std::cerr << "Discarding corrupt cache entry: " << path << std::endl;
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        UpdateStats([](CacheStats &s)
+                    { ++s.misses; });
+        return std::nullopt;
+    }
+
+    // 读取 (0020,000E) SeriesInstanceUID
+    static std::string ReadSeriesInstanceUID(const std::string &fileName)
+    {
+        gdcm::Reader reader;
+        reader.SetFileName(fileName.c_str());
+        if (!reader.ReadUpToTag(gdcm::Tag(0x0020, 0x000e)))
+        {
+            throw std::runtime_error("Cannot read DICOM header: " + fileName);
+        }
+        gdcm::StringFilter filter;
+        filter.SetFile(reader.GetFile());
+        return filter.ToString(gdcm::Tag(0x0020, 0x000e));
+    }
+
+    // 单个切片的标识: (0008,0018) SOPInstanceUID + 传输语法 + 像素数据的字节数
+    // 只读取到像素数据之前 (跳过 (7FE0,0010) 的值), 像素数据长度取文件大小减去其起始位置, 压缩数据同样适用
+    static std::string SliceDigest(const std::string &fileName)
+    {
+        gdcm::Reader reader;
+        reader.SetFileName(fileName.c_str());
+        const gdcm::Tag pixelTag(0x7fe0, 0x0010);
+        if (!reader.ReadUpToTag(pixelTag, {pixelTag}))
+        {
+            throw std::runtime_error("Cannot read DICOM header: " + fileName);
+        }
+        gdcm::StringFilter filter;
+        filter.SetFile(reader.GetFile());
+
+        const uint64_t fileSize = std::filesystem::file_size(fileName);
+        const uint64_t pixelOffset = reader.GetStreamCurrentPosition();
+        const uint64_t pixelBytes = pixelOffset > 0 && pixelOffset <= fileSize ? fileSize - pixelOffset : fileSize;
+
+        Fnv1a digest;
+        digest.Update(filter.ToString(gdcm::Tag(0x0008, 0x0018)));
+        const char *ts = gdcm::TransferSyntax::GetTSString(reader.GetFile().GetHeader().GetDataSetTransferSyntax());
+        digest.Update(ts ? ts : "");
+        digest.Update(&pixelBytes, sizeof(pixelBytes));
+        return digest.Hex();
+    }
+
+    // 模型文件内容哈希; 以 (路径, 大小, 修改时间) 记忆在缓存目录中, 避免每次都读取整个模型
+    std::string ModelHash(const std::string &modelPath)
+    {
+        std::filesystem::path model = std::filesystem::absolute(modelPath);
+        Fnv1a memoKey;
+        memoKey.Update(model.string());
+        uint64_t size = std::filesystem::file_size(model);
+        int64_t mtime = std::filesystem::last_write_time(model).time_since_epoch().count();
+        memoKey.Update(&size, sizeof(size));
+        memoKey.Update(&mtime, sizeof(mtime));
+
+        std::filesystem::path memo = dir_ / "models" / memoKey.Hex();
+        std::string hash;
+        if (std::ifstream(memo) >> hash)
+            return hash;
+
+        Fnv1a content;
+        std::ifstream in(model, std::ios::binary);
+        std::vector<char> chunk(1 << 20);
+        while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0)
+        {
+            content.Update(chunk.data(), static_cast<size_t>(in.gcount()));
+        }
+        hash = content.Hex();
+        std::ofstream(memo) << hash;
+        return hash;
+    }
+
+    // 清除已退出进程留下的临时文件; 总大小超过上限时, 按修改时间从旧到新删除结果文件
+    void Evict()
+    {
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> entries;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(dir_ / "results", ec))
+        {
+            if (!entry.is_regular_file())
+                continue;
+            // 写入中途崩溃的进程留下的临时文件
+            std::string name = entry.path().filename().string();
+            size_t tmpPos = name.rfind(".bin.tmp");
+            if (tmpPos != std::string::npos)
+            {
+                long pid = std::strtol(name.c_str() + tmpPos + 8, nullptr, 10);
+                if (pid > 0 && ::kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH)
+                    std::filesystem::remove(entry.path(), ec);
+                continue;
+            }
+            if (entry.path().extension() != ".bin")
+                continue;
+            total += entry.file_size(ec);
+            entries.emplace_back(entry.last_write_time(ec), entry.path());
+        }
+        if (total <= maxBytes_)
+            return;
+
+        std::sort(entries.begin(), entries.end());
+        for (const auto &[time, path] : entries)
+        {
+            if (total <= maxBytes_)
+                break;
+            uint64_t size = std::filesystem::file_size(path, ec);
+            if (std::filesystem::remove(path, ec))
+                total -= size;
+        }
+    }
+
+    // 在文件锁保护下读-改-写统计文件
+    template <typename Fn>
+    void UpdateStats(Fn &&fn)
+    {
+        std::filesystem::path path = dir_ / "stats";
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return;
+        ::flock(fd, LOCK_EX);
+
+        CacheStats stats;
+        if (::pread(fd, &stats, sizeof(stats), 0) != static_cast<ssize_t>(sizeof(stats)))
+            stats = CacheStats();
+        fn(stats);
+        ssize_t written = ::pwrite(fd, &stats, sizeof(stats), 0);
+        (void)written;
+
+        ::flock(fd, LOCK_UN);
+        ::close(fd);
+    }
+
+    std::filesystem::path dir_;
+    uint64_t maxBytes_;
+    double verifyRate_;
+    std::mt19937_64 rng_;
+};
+
+// 比较两次推理结果是否一致 (张量逐元素比较, tuple / list 递归比较)
+inline bool SameInferenceResult(const torch::jit::IValue &a, const torch::jit::IValue &b)
+{
+    if (a.isTensor() && b.isTensor())
+    {
+        const torch::Tensor ta = a.toTensor().cpu();
+        const torch::Tensor tb = b.toTensor().cpu();
+        return ta.sizes() == tb.sizes() && ta.dtype() == tb.dtype() && torch::allclose(ta, tb, 1e-4, 1e-5);
+    }
+    if (a.isTuple() && b.isTuple())
+    {
+        const auto &ea = a.toTuple()->elements();
+        const auto &eb = b.toTuple()->elements();
+        if (ea.size() != eb.size())
+            return false;
+        for (size_t i = 0; i < ea.size(); ++i)
+        {
+            if (!SameInferenceResult(ea[i], eb[i]))
+                return false;
+        }
+        return true;
+    }
+    if (a.isList() && b.isList())
+    {
+        auto la = a.toListRef();
+        auto lb = b.toListRef();
+        if (la.size() != lb.size())
+            return false;
+        for (size_t i = 0; i < la.size(); ++i)
+        {
+            if (!SameInferenceResult(la[i], lb[i]))
+                return false;
+        }
+        return true;
+    }
+    return torch::jit::pickle_save(a) == torch::jit::pickle_save(b);
+}
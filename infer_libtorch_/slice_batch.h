@@ -0,0 +1,110 @@
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+#include "model_output.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+// 2D 逐切片推理参数
+struct SliceBatchOptions
+{
+    int axis = 2;       // 切片方向: 0 = X (sagittal), 1 = Y (coronal), 2 = Z (axial)
+    int context = 0;    // 2.5D 上下各堆叠的相邻切片数, 通道数 C = 2 * context + 1
+    int batch_size = 16;
+};
+
+// 2D 推理结果: 输出与输入平面大小一致时重组为体数据 [Co, X, Y, Z], 否则按切片堆叠 [S, ...]
+struct SliceBatchResult
+{
+    torch::Tensor volume;
+    torch::Tensor per_slice;
+};
+
+// 将体数据按某个方向切片, 以 [N, C, H, W] 批量送入 2D 模型, 再把预测结果重组回体数据
+// volume: [X, Y, Z] 张量; 切片平面的 [H, W] 为剩余两个轴的逆序 (axial 时为 [Y, X])
+// 切片通过 permute 得到视图, 每个批次只用 index_select 拷贝本批次需要的切片
+inline SliceBatchResult RunSliceBatchInference(torch::jit::script::Module &module, const torch::Tensor &volume,
+                                               const SliceBatchOptions &options, torch::Device device)
+{
+    if (volume.dim() != 3)
+    {
+        throw std::runtime_error("Slice-batch inference expects a [X, Y, Z] volume.");
+    }
+    if (options.axis < 0 || options.axis > 2)
+    {
+        throw std::runtime_error("Slice axis must be 0, 1 or 2.");
+    }
+    if (options.context < 0)
+    {
+        throw std::runtime_error("Slice context must not be negative.");
+    }
+
+    // 剩余的两个轴, a < b
+    int a = options.axis == 0 ? 1 : 0;
+    int b = options.axis == 2 ? 1 : 2;
+
+    // [S, H, W] 视图, 不拷贝数据
+    torch::Tensor slices = volume.permute({options.axis, b, a});
+    const int64_t numSlices = slices.size(0);
+    const int64_t channels = 2 * options.context + 1;
+    const int64_t batchSize = std::max(1, options.batch_size);
+
+    SliceBatchResult result;
+    torch::Tensor volumeView;
+    std::vector<torch::Tensor> perSlice;
+
+    torch::NoGradGuard no_grad;
+    double forwardMs = 0.0;
+
+    for (int64_t s0 = 0; s0 < numSlices; s0 += batchSize)
+    {
+        int64_t s1 = std::min(numSlices, s0 + batchSize);
+        int64_t n = s1 - s0;
+
+        // 每个切片的 C 个相邻切片索引, 边界处截断到 [0, S - 1]
+        torch::Tensor offsets = torch::arange(-options.context, options.context + 1, torch::kLong);
+        torch::Tensor centers = torch::arange(s0, s1, torch::kLong).unsqueeze(1);
+        torch::Tensor index = (centers + offsets).clamp(0, numSlices - 1).reshape({-1});
+
+        // [N * C, H, W] -> [N, C, H, W]
+        torch::Tensor batch = slices.index_select(0, index.to(slices.device()));
+        batch = batch.view({n, channels, batch.size(1), batch.size(2)}).to(device);
+
+        auto t0 = std::chrono::steady_clock::now();
+        torch::jit::IValue output = module.forward({batch});
+        forwardMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        torch::Tensor pred = FirstOutputTensor(output);
+        pred = pred.to(volume.device());
+
+        // 输出为与输入同大小的 [N, Co, H, W] 时写回体数据对应的切片
+        bool spatial = pred.dim() == 4 && pred.size(2) == slices.size(1) && pred.size(3) == slices.size(2);
+        if (spatial)
+        {
+            if (!result.volume.defined())
+            {
+                std::vector<int64_t> shape{pred.size(1), volume.size(0), volume.size(1), volume.size(2)};
+                result.volume = torch::empty(shape, pred.options());
+                volumeView = result.volume.permute({0, options.axis + 1, b + 1, a + 1}); // [Co, S, H, W]
+            }
+            volumeView.slice(1, s0, s1).copy_(pred.transpose(0, 1));
+        }
+        else
+        {
+            perSlice.push_back(pred);
+        }
+    }
+
+    if (!perSlice.empty())
+    {
+        result.per_slice = torch::cat(perSlice, 0);
+    }
+
+    std::cout << "Slice-batch inference: " << numSlices << " slices, batch " << batchSize << ", " << channels
+              << " channels, forward " << forwardMs << " ms" << std::endl;
+    return result;
+}